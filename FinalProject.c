@@ -9,10 +9,41 @@
 
 #include <stdlib.h>
 
-#define FIO0PIN (*(volatile unsigned int *) 0x2009c014)
-#define FIO0DIR (*(volatile unsigned int *) 0x2009c000)
-#define PINMODE0 (*(volatile unsigned int *) 0x4002c040)
-#define PINMODE1 (*(volatile unsigned int *) 0x4002c044)
+// Building with -DHOST_SIM compiles the game for a Linux host. Peripheral registers
+// become plain memory, time comes from a simulated us clock and the LCD is the
+// HD44780 emulator at the bottom of this file
+#ifdef HOST_SIM
+volatile unsigned int simRegisters[0x80000];
+#define REG(addr) simRegisters[(((addr) >> 2) & 0x3FFFF) ^ (((addr) >> 28) << 15)]
+#else
+#define REG(addr) (*(volatile unsigned int *) (addr))
+#endif
+
+// adding -DHOST_TEST replaces the game's main with the host test driver at the bottom of
+// this file, make test builds and runs it
+#ifdef HOST_TEST
+#ifndef HOST_SIM
+#error "HOST_TEST needs HOST_SIM"
+#endif
+#include <stdio.h>
+#include <string.h>
+#endif
+
+#define FIO0PIN REG(0x2009c014)
+#define FIO0DIR REG(0x2009c000)
+#define FIO0SET REG(0x2009c018)
+#define FIO0CLR REG(0x2009c01c)
+#define FIO0MASK REG(0x2009c010)
+
+// writes FIO0PIN through FIO0MASK, only the pins with a 0 in the mask change. The host
+// registers are plain memory, so there the mask is applied by hand
+#ifdef HOST_SIM
+#define FIO0PIN_MASKED(value) (FIO0PIN = (FIO0PIN & FIO0MASK) | ((value) & ~FIO0MASK))
+#else
+#define FIO0PIN_MASKED(value) (FIO0PIN = (value))
+#endif
+#define PINMODE0 REG(0x4002c040)
+#define PINMODE1 REG(0x4002c044)
 
 // 8 bit gameMap info  000     00      000
 //					   ships   weapon  stars
@@ -38,53 +69,386 @@
 #define collisionAtPosition 0xE0
 
 // Timer interrupt registers
-#define T0IR (*(volatile unsigned int *) 0x40004000)
-#define T0TCR (*(volatile unsigned int *) 0x40004004)
-#define T0TC (*(volatile unsigned int *) 0x40004008)
-#define T0MCR (*(volatile unsigned int *) 0x40004014)
-#define T0MR0 (*(volatile unsigned int *) 0x40004018)
-#define T0MR1 (*(volatile unsigned int *) 0x4000401C)
-#define ISER0 (*(volatile unsigned int *) 0xE000E100)
+#define T0IR REG(0x40004000)
+#define T0TCR REG(0x40004004)
+#define T0TC REG(0x40004008)
+#define T0MCR REG(0x40004014)
+#define T0MR0 REG(0x40004018)
+#define T0MR1 REG(0x4000401C)
+#define T0MR3 REG(0x40004024)
+#define ISER0 REG(0xE000E100)
+#define ICER0 REG(0xE000E180)
+
+// PWM1 registers. PWM1.1 on P2.0 drives the piezo, MR0 sets the period and MR1 the
+// time the output is high, both in us
+#define PINSEL4 REG(0x4002C010)
+#define PWM1TCR REG(0x40018004)
+#define PWM1PR REG(0x4001800C)
+#define PWM1MCR REG(0x40018014)
+#define PWM1MR0 REG(0x40018018)
+#define PWM1MR1 REG(0x4001801C)
+#define PWM1PCR REG(0x4001804C)
+#define PWM1LER REG(0x40018050)
+
+// Cortex-M3 cycle counter, used to time interrupt handlers
+#define DEMCR REG(0xE000EDFC)
+#define DWT_CTRL REG(0xE0001000)
+#define DWT_CYCCNT REG(0xE0001004)
+
+// set to 1 to play sound from the DAC instead of the piezo. GPDMA channel 0 feeds the DAC
+// sample blocks that a software mixer fills, so sampled effects can play alongside the
+// envelope voices. AOUT is P0.26, so the keypad input there moves to P0.11
+#ifndef SOUND_DAC
+#define SOUND_DAC 0
+#endif
+
+// DAC and GPDMA registers for the SOUND_DAC build. The DAC timer asks for a sample every
+// DACCNTVAL counts and channel 0 moves it from memory to DACR
+#define PINSEL1 REG(0x4002C004)
+#define PCONP REG(0x400FC0C4)
+#define DACR_ADDRESS 0x4008C000
+#define DACR REG(DACR_ADDRESS)
+#define DACCTRL REG(0x4008C004)
+#define DACCNTVAL REG(0x4008C008)
+#define DMACIntTCStat REG(0x50004004)
+#define DMACIntTCClear REG(0x50004008)
+#define DMACIntErrClr REG(0x50004010)
+#define DMACConfig REG(0x50004030)
+#define DMACC0SrcAddr REG(0x50004100)
+#define DMACC0DestAddr REG(0x50004104)
+#define DMACC0LLI REG(0x50004108)
+#define DMACC0Control REG(0x5000410C)
+#define DMACC0Config REG(0x50004110)
+
+// Timer1 registers. Timer1 is the system clock, counting us since boot, MR0
+// paces the LCD transmit queue, MR2 raises the game tick and MR3 scans the keypad
+#define T1IR REG(0x40008000)
+#define T1TCR REG(0x40008004)
+#define T1TC REG(0x40008008)
+#define T1PR REG(0x4000800C)
+#define T1MCR REG(0x40008014)
+#define T1MR0 REG(0x40008018)
+#define T1MR1 REG(0x4000801C)
+#define T1MR2 REG(0x40008020)
+#define T1MR3 REG(0x40008024)
+
+// core clock, 4 MHz out of reset from the internal RC oscillator. Builds that
+// change the clock set this on the command line so every delay and the frame
+// rate stay the same. Peripherals run at the default CCLK / 4
+#ifndef CCLK_HZ
+#define CCLK_HZ 4000000
+#endif
+#define PCLK_HZ (CCLK_HZ / 4)
+
+// core clock cycles E is held high, and then low, on every LCD strobe. 500 ns covers the
+// 450 ns E pulse width and half the 1000 ns enable cycle time the HD44780 needs, rounded
+// up so it holds at any CCLK_HZ
+#define LCD_E_HOLD_CYCLES (((CCLK_HZ / 1000) * 500 + 999999) / 1000000)
+
+// display geometry. LCD_PANEL picks the panel: 1602 for 16x2, 2004 for 20x4 or 4004 for
+// 40x4. The 40x4 panel is two controllers with a 40x2 layout each, the first drives lines
+// 0 and 1 and the second lines 2 and 3, each on its own E line.
+// LCD_ROW_BASE is the DDRAM address of a line's first column, LCD_ROW_CONTROLLER the
+// controller it is on, and LCD_DDRAM_ROW the line that comes k-th in DDRAM address order.
+// LCD_ROW_CELLS expands f(row, column) once for every column of a line
+#ifndef LCD_PANEL
+#define LCD_PANEL 2004
+#endif
+
+#if LCD_PANEL == 1602
+#define LCD_COLS 16
+#define LCD_ROWS 2
+#define LCD_CONTROLLERS 1
+#define LCD_ROW_BASE(r) ((r) * 0x40)
+#define LCD_ROW_CONTROLLER(r) 0
+#define LCD_DDRAM_ROW(k) (k)
+#define LCD_ROW_CELLS(f, r) LCD_CELLS16(f, r, 0)
+#elif LCD_PANEL == 2004
+#define LCD_COLS 20
+#define LCD_ROWS 4
+#define LCD_CONTROLLERS 1
+#define LCD_ROW_BASE(r) (((r) & 1) * 0x40 + ((r) >> 1) * 0x14)
+#define LCD_ROW_CONTROLLER(r) 0
+#define LCD_DDRAM_ROW(k) ((((k) & 1) << 1) | ((k) >> 1))
+#define LCD_ROW_CELLS(f, r) LCD_CELLS16(f, r, 0), LCD_CELLS4(f, r, 16)
+#elif LCD_PANEL == 4004
+#define LCD_COLS 40
+#define LCD_ROWS 4
+#define LCD_CONTROLLERS 2
+#define LCD_ROW_BASE(r) (((r) & 1) * 0x40)
+#define LCD_ROW_CONTROLLER(r) ((r) >> 1)
+#define LCD_DDRAM_ROW(k) (k)
+#define LCD_ROW_CELLS(f, r) LCD_CELLS16(f, r, 0), LCD_CELLS16(f, r, 16), LCD_CELLS4(f, r, 32), \
+                            LCD_CELLS4(f, r, 36)
+#else
+#error "LCD_PANEL must be 1602, 2004 or 4004"
+#endif
+
+#define LCD_CELLS (LCD_COLS * LCD_ROWS)
+
+#define LCD_CELLS4(f, r, c) f(r, c), f(r, (c) + 1), f(r, (c) + 2), f(r, (c) + 3)
+#define LCD_CELLS16(f, r, c) LCD_CELLS4(f, r, c), LCD_CELLS4(f, r, (c) + 4), \
+                             LCD_CELLS4(f, r, (c) + 8), LCD_CELLS4(f, r, (c) + 12)
+#if LCD_ROWS == 2
+#define LCD_ALL_CELLS(f) LCD_ROW_CELLS(f, 0), LCD_ROW_CELLS(f, 1)
+#else
+#define LCD_ALL_CELLS(f) LCD_ROW_CELLS(f, 0), LCD_ROW_CELLS(f, 1), LCD_ROW_CELLS(f, 2), \
+                         LCD_ROW_CELLS(f, 3)
+#endif
+
+// line and column of a gameMap location, locations run along each line in turn
+#define LOCATION_ROW(location) ((location) / LCD_COLS)
+#define LOCATION_COLUMN(location) ((location) % LCD_COLS)
+#define LAST_COLUMN (LCD_COLS - 1)
+
+// one bit per column of a line, for the occupancy masks and the star field
+#if LCD_COLS > 32
+typedef unsigned long long RowBits;
+#define ROW_CTZ(x) __builtin_ctzll(x)
+#else
+typedef unsigned int RowBits;
+#define ROW_CTZ(x) __builtin_ctz(x)
+#endif
+#define ROW_BIT(column) ((RowBits) 1 << (column))
+
+// set DDRAM address command for each gameMap location, with the controller it is on in
+// bits 8 and 9 (see LCD_CMD_SELECT)
+#define LCD_ADDRESS_CODE(r, c) \
+    (0x80 | (LCD_ROW_BASE(r) + (c)) | (1 << (8 + LCD_ROW_CONTROLLER(r))))
+const unsigned short AddressCodes[LCD_CELLS] = { LCD_ALL_CELLS(LCD_ADDRESS_CODE) };
+
+// gameMap locations sorted by their address code, so writeDisplay can walk the display in
+// the order the address counter increments, and where each location sits in that order.
+// LCD_DDRAM_ROW at most swaps lines 1 and 2, so it is its own inverse and builds both
+#define LCD_DDRAM_LOCATION(k, c) (LCD_DDRAM_ROW(k) * LCD_COLS + (c))
+const unsigned char displayOrder[LCD_CELLS] = { LCD_ALL_CELLS(LCD_DDRAM_LOCATION) };
+const unsigned char cellOrder[LCD_CELLS] = { LCD_ALL_CELLS(LCD_DDRAM_LOCATION) };
 
 // Arrays
-int AddressCodes[80];
-int gameMap[80];
-int gameMapLast[80];
+unsigned char gameMap[LCD_CELLS];
+
+// one bit per display location that needs to be redrawn, indexed by position in
+// DDRAM order so writeDisplay finds them in the order the address counter runs
+#define DIRTY_WORDS ((LCD_CELLS + 31) / 32)
+unsigned int dirtyCells[DIRTY_WORDS];
+
+// locations writeDisplay leaves alone, in the same order. An explosion flash holds its
+// locations so redraws wait until it is over
+unsigned int heldCells[DIRTY_WORDS];
 
 const int DB[] = {9, 8, 7, 6, 0, 1, 18, 17};		// Bits corresponding to pins 5-12
 
 const int Control[] = {15, 16, 23};					// Bits corresponding pins 13-15
 // Bit 15 is E, 16 is R/W, and 23 is RS
+
+// port masks for the control lines, must match the Control array
+#define LCD_E (1 << 15)
+#define LCD_RW (1 << 16)
+#define LCD_RS (1 << 23)
+
+// E line of the second controller on a dual controller panel, P0.10 (pin 28)
+#if LCD_CONTROLLERS == 2
+#define LCD_E2 (1 << 10)
+#else
+#define LCD_E2 0
+#endif
+
+// controllers a transfer goes to, bit 0 for the first and bit 1 for the second. Commands
+// carry it in bits 8 and 9, none set means every controller. That is what the init,
+// clear and CGRAM commands want, each controller has its own CGRAM. Data goes to the
+// controllers the last command went to
+#define LCD_SELECT_ALL ((1 << LCD_CONTROLLERS) - 1)
+#define LCD_CMD_SELECT(cmd) (((cmd) >> 8) & 3 ? ((cmd) >> 8) & LCD_SELECT_ALL : LCD_SELECT_ALL)
+#define LCD_ENABLE_PINS(select) (((select) & 1 ? LCD_E : 0) | ((select) & 2 ? LCD_E2 : 0))
+
+// spreads a byte over the DB pins in the same order as the DB array
+#define DB_PINS(b) ((((b) >> 0 & 1) << 9)  | (((b) >> 1 & 1) << 8) | \
+                    (((b) >> 2 & 1) << 7)  | (((b) >> 3 & 1) << 6) | \
+                    (((b) >> 4 & 1) << 0)  | (((b) >> 5 & 1) << 1) | \
+                    (((b) >> 6 & 1) << 18) | (((b) >> 7 & 1) << 17))
+#define DB_PINS4(b) DB_PINS(b), DB_PINS((b) + 1), DB_PINS((b) + 2), DB_PINS((b) + 3)
+#define DB_PINS16(b) DB_PINS4(b), DB_PINS4((b) + 4), DB_PINS4((b) + 8), DB_PINS4((b) + 12)
+
+// every DB pin at once
+#define DB_ALL DB_PINS(0xFF)
+
+// FIO0MASK for the 4 bit interface, the nibble stores and E pulses may only change
+// DB4-DB7, R/W, RS and the E pins
+#define LCD_NIBBLE_MASK (~(DB_PINS(0xF0) | LCD_RW | LCD_RS | LCD_E | LCD_E2))
+
+// set to 1 to drive the LCD over its 4 bit interface. Only DB4-DB7 (pins 0, 1, 18
+// and 17) are used and DB0-DB3 (pins 9, 8, 7 and 6) are left free for other uses
+#ifndef LCD_BUS_4BIT
+#define LCD_BUS_4BIT 0
+#endif
+
+// the DB pins the driver owns
+#if LCD_BUS_4BIT
+#define DB_BUS DB_PINS(0xF0)
+#else
+#define DB_BUS DB_ALL
+#endif
+
+// port set mask for each byte value, built by the compiler so it lives in flash.
+// The clear mask for a byte is DB_ALL with the set bits removed
+const unsigned int DBSetMasks[256] = {
+    DB_PINS16(0x00), DB_PINS16(0x10), DB_PINS16(0x20), DB_PINS16(0x30),
+    DB_PINS16(0x40), DB_PINS16(0x50), DB_PINS16(0x60), DB_PINS16(0x70),
+    DB_PINS16(0x80), DB_PINS16(0x90), DB_PINS16(0xA0), DB_PINS16(0xB0),
+    DB_PINS16(0xC0), DB_PINS16(0xD0), DB_PINS16(0xE0), DB_PINS16(0xF0)
+};
+
+// port set mask for each nibble on DB4-DB7, used by the 4 bit interface
+const unsigned int DBNibbleMasks[16] = {
+    DB_PINS(0x00), DB_PINS(0x10), DB_PINS(0x20), DB_PINS(0x30),
+    DB_PINS(0x40), DB_PINS(0x50), DB_PINS(0x60), DB_PINS(0x70),
+    DB_PINS(0x80), DB_PINS(0x90), DB_PINS(0xA0), DB_PINS(0xB0),
+    DB_PINS(0xC0), DB_PINS(0xD0), DB_PINS(0xE0), DB_PINS(0xF0)
+};
+
+// writeDisplay rewrites up to this many unchanged cells to bridge two changed ones,
+// a set address command costs one transfer so a single cell gap is free
+#define LCD_RUN_GAP_MAX 1
+
+// set to 1 to poll the LCD busy flag after each transfer instead of waiting a fixed 200 us
+#ifndef LCD_BUSY_POLL
+#define LCD_BUSY_POLL 1
+#endif
+
+// us the busy flag can stay up before a transfer gives up and falls back to the fixed
+// delay, long enough to cover the 1.52 ms clear display instruction. It is timed on the
+// us clock so it is the same at any CCLK_HZ and on either interface
+#define LCD_BUSY_TIMEOUT_US 2000
+
+// entries in the LCD transmit queue, must be a power of two
+#define LCD_QUEUE_SIZE 256
+
+// queue entry layout: bits 0-7 are the byte, bit 8 is RS and bits 10 and 11 are the
+// controller select
+#define LCD_Q_RS (1 << 8)
+#define LCD_Q_SELECT_SHIFT 10
+
+// time the queue allows the controller per transfer in us, from the HD44780 datasheet
+// (37 us, 1.52 ms for clear display and return home) plus margin. Used when the busy
+// flag is not being polled
+#define LCD_EXEC_US 50
+#define LCD_EXEC_LONG_US 1600
+
+// us between busy flag reads while the queue waits for the controller in busy flag mode,
+// each read is one short MR0 interrupt
+#define LCD_POLL_US 10
+
 // output pins for keypad
 const int KeyBitsOut[] = {24, 25};					// Pins 16,17 keypad outputs
 
 // input pins for keypad
+#if SOUND_DAC
+const int KeyBitsIn[] = {11, 2, 3};					// P0.26 is AOUT, the first input moves to P0.11
+#else
 const int KeyBitsIn[] = {26, 2, 3};					// Pins 18,21,22 keypad inputs
+#endif
+
+// starts Timer1 as a free running us clock, must run before anything waits
+void clockInitialize(void);
+
+// us since boot, wraps every 71 minutes. The difference of two readings is right across
+// a wrap, and nothing in the game times anything that long
+unsigned int micros(void);
+
+// busy waits on the clock
+void delay_us(unsigned int);
+void delay_until(unsigned int);
 
 // wait functions
 void wait_100us(void);
 void wait_ms(int);
-void wait_ticks(int);
 
 // write command and write data functions
 void LCDwriteCommand(int);
 void LCDwriteData(int);
 
+// puts one byte on the LCD bus and pulses E of the selected controllers, then waits
+// for them. rs selects data (1) or command (0)
+void LCDbusWrite(int, int, int);
+
+// puts one byte on the LCD bus and pulses the given E pins without waiting
+void LCDbusStrobe(int, int, int);
+
+// spins for LCD_E_HOLD_CYCLES on the cycle counter
+void LCDenableHold(void);
+
+// puts one nibble on DB4-DB7 and pulses the given E pins, used by the 4 bit interface
+void LCDnibbleStrobe(int, int, int);
+
+// times full screen writes over the synchronous driver, see LCD_BENCHMARK
+void LCDbenchmark(void);
+
+// starts Timer1 draining the LCD transmit queue, after this point
+// LCDwriteCommand and LCDwriteData only enqueue
+void LCDqueueInitialize(void);
+
+// adds an entry to the LCD transmit queue
+void LCDqueuePush(int);
+
+// counts game ticks, scans the keypad and drains the LCD transmit queue at the controller's pace
+void TIMER1_IRQHandler(void);
+
+// starts Timer1 MR2 raising tickCount every TICK_US
+void tickInitialize(void);
+
+// sleeps until tickCount moves on from a tick
+void waitForTick(unsigned int);
+
+// polls the busy flag of the controller on an E pin until it is ready, returns 0 on timeout
+int LCDwaitReady(int);
+
+// reads the busy flag of the controller on an E pin once, 1 while it is busy
+int LCDreadBusy(int);
+
+// raises an E pin and reads the busy flag (DB7) while it is high
+int LCDreadBusyFlag(int);
+
+#ifdef HOST_SIM
+// simulated controllers and clock used by the host build
+void simLCDstrobe(int, int, int);
+void simLCDnibble(int, int, int);
+int simLCDreadBusyFlag(int);
+void simLCDframeReset(void);
+int simLCDcharAt(int, int);
+void simLCDgrid(char [LCD_ROWS][LCD_COLS + 1]);
+void simWaitForInterrupt(void);
+void simTimer1Match(int);
+void simAdvanceUs(unsigned int);
+void simKeypadDrive(int);
+void simKeypadSet(int);
+#if SOUND_DAC
+void simDacRun(unsigned int);
+#endif
+#endif
+
 // initializes the lcd
 void InitializeLCD(void);
 
-// puts the display address codes into an array for ease of use
-void createDispAdd(void);
-
 // initialize the output pins
 void initOutPins(void);
 
 // configure the input pins
 void configInPins(void);
 
-// detects a keypress from the numpad
+// acts on the keypad events, runs every tick
 void keyDetect(void);
 
+// drives the first keypad output and starts Timer1 MR3 scanning the keypad. The pins
+// are already set up by InitializeLCD
+void keypadInitialize(void);
+
+// reads one keypad output's keys and debounces the whole keypad once both have been
+// read, called from TIMER1_IRQHandler on MR3
+void keypadScan(void);
+
+// adds a key event to keyEvents
+void keyEventPush(int, int, unsigned int);
+
 // places the initial elements into the gameMap array
 void populateBackground(void);
 
@@ -94,20 +458,129 @@ void scrollBackground(void);
 // twinkles the stars
 void animateStars(void);
 
+// sets up PWM1 to drive the piezo, or the DAC in the SOUND_DAC build, and starts the
+// cycle counter for the load figures
+void soundInitialize(void);
+
+// plays one of the SFX_ sound effects on its voice
+void soundPlay(int);
+
+// starts a voice on a run of envelope steps, from inside TIMER0_IRQHandler or with
+// Timer0 interrupts off
+struct EnvelopeStep;
+void setVoice(int, const struct EnvelopeStep *, int);
+
+// steps every voice one frame and gives the piezo to the next one, called from
+// TIMER0_IRQHandler on MR0
+void soundFrame(void);
+
+// loads an envelope step into PWM1, 0 for silence
+void pwmLoad(const struct EnvelopeStep *);
+
+#if SOUND_DAC
+// sets up the DAC and GPDMA channel 0 to play dacBuffer over and over
+void dacInitialize(void);
+
+// mixes the next block of samples into a dacBuffer, called from DMA_IRQHandler
+void soundMixBlock(unsigned int *);
+
+// adds a voice's sample to a block, called from soundMixBlock
+struct SampleChannel;
+void mixSample(volatile struct SampleChannel *, int *);
+
+// refills the DAC block GPDMA just finished with
+void DMA_IRQHandler(void);
+#endif
+
+// music track, see introTrack
+struct Track;
+
+// plays a track from its first note, replacing anything playing or queued
+void musicStart(const struct Track *);
+
+// plays a track once the one playing finishes, or straight away when nothing is
+void musicQueue(const struct Track *);
+
+// silences the music and forgets any queued track
+void musicStop(void);
+
+// true while a track is playing
+int musicPlaying(void);
+
+// moves the sequencer on to the next note, called from TIMER0_IRQHandler on MR3
+void musicNextEvent(void);
+
+// runs the title screen and starts each game
+void gameFlow(void);
+
+// steps every explosion flash on screen
+void runFlashes(void);
+
+// steps one explosion flash, given its flashPool slot
+void flashStep(int);
+
+// shows an explosion flash over one or two locations
+void startFlash(int, int);
+
+// adds a star to the star field bitplanes
+void placeStar(int, int);
+
+// copies the star field bitplanes into the gameMap for the changed columns of a line
+void syncStars(int, RowBits);
+
 // writes the gameMap array to the display
 void writeDisplay(void);
 
-// writes appropriate star to display
-void writeStar(int);
+// returns the sprite for a gameMap location
+int cellGlyph(int);
+
+// returns the character code to draw a sprite with, loading it into CGRAM if needed
+int spriteChar(int);
+
+// true when a sprite is not in CGRAM yet
+int spriteNeedsUpload(int);
 
-// writes a collision animation to the display
-void writeCollision(int, int, int);
+// records the character shown at a location and keeps the CGRAM slot counts up to date
+void setDisplayChar(int, int);
 
-// writes a weapon to the display
-void writeWeapon(int);
+// forgets what is on screen after the whole display was blanked
+void resetDisplayChars(void);
 
-// writes a ship to the display
-void writeShip(int, int);
+// all gameMap changes go through here so the location is marked for redrawing
+void setGameMap(int, int);
+
+// marks a location to be redrawn by writeDisplay
+void markCellDirty(int);
+
+// marks every location to be redrawn
+void markAllCellsDirty(void);
+
+// returns the appropriate star sprite
+int starGlyph(int);
+
+// rebuilds the row occupancy masks from the entity pools for resolveCollisions
+void buildOccupancy(void);
+
+// finds and resolves every collision from the row occupancy masks
+void resolveCollisions(void);
+
+// removes the player's ship and starts its collision animation
+void destroyPlayer(void);
+
+// removes an enemy ship, given its enemyPool slot, and starts its collision animation
+void destroyEnemy(int);
+
+// puts a collision marker at a location and starts its animation
+void startCollision(int);
+
+// returns the weapon sprite
+int weaponGlyph(int);
+
+// returns the rear ship sprite, or the collision frame at a location
+int shipGlyph(int, int);
+
+// returns the front ship sprite
+int shipFrontGlyph(int);
 
 // moves weapons across the display
 void moveWeapons(void);
@@ -134,920 +607,2028 @@ void startGame(void);
 void TimerInterruptInitialize(void);
 void TIMER0_IRQHandler(void);
 
+// lines every inPlay task up to run its phase ticks from the current tick
+void schedulerStart(void);
+
+// runs every task that is due on schedulerTick
+void runDueTasks(void);
+
+// moves a task's next run to a number of ticks from the current tick
+void delayTask(int, int);
+
+// steps the game once for every tick since the last step, up to SIM_MAX_CATCHUP of them
+void runSimulation(void);
+
+// draws the latest game state once the display has taken the last frame
+void renderFrame(void);
+
+// updates the per second simulation and frame rates
+void updateRates(void);
+
 // used for masking off the individual elements out of the 8bit gameMap data
 const int starMask = 0x07;
 const int weaponMask = 0x18;
 const int shipMask = 0xE0;
 
+// gameMap field accessors. Each field is read and written through its mask, so
+// changing one can never carry into the field next to it. Values are the shifted
+// constants above, e.g. setCellShip(i, shipFB) or setCellStar(i, noStar)
+static inline int cellShip(int location){
+    return gameMap[location] & shipMask;
+}
+static inline int cellWeapon(int location){
+    return gameMap[location] & weaponMask;
+}
+static inline int cellStar(int location){
+    return gameMap[location] & starMask;
+}
+static inline void setCellField(int location, int mask, int value){
+    setGameMap(location, (gameMap[location] & ~mask) | (value & mask));
+}
+static inline void setCellShip(int location, int ship){
+    setCellField(location, shipMask, ship);
+}
+static inline void setCellWeapon(int location, int weapon){
+    setCellField(location, weaponMask, weapon);
+}
+static inline void setCellStar(int location, int star){
+    setCellField(location, starMask, star);
+}
+
 // flag used to check if player has been killed
 int playerDown;
 
-// flag used for setting start game conditions
-int startGameNow = 1;
-
-// loop variables for telling functions when to run an animation or debounce the keypad
-int loopCountShiftStars = 0;
-int loopCountAniStars = 0;
-int loopWeaponBlast = 0;
-int loopDebounceCount = 0;
-int loopCollision = 0;
-int loopSpam = 0;
-int loopSpawnEnemy = 0;
-int loopMoveEnemy = 0;
-int loopEnemyFire = 0;
-
-// fastest speed in milliseconds that the screen can update
-int baseAnimateSpeed = 1;
-
-// starting note pitch for laser blast
-int noteValue = 1000;
-
-// animate flag is used when a function updates the gameMap and needs the animation updated to the display
-int animateFlag;
+// keypad keys by their bit in a key mask. The first three are read with KeyBitsOut[0]
+// driven and the rest with KeyBitsOut[1], each in KeyBitsIn order
+enum {
+    KEY_HASH,
+    KEY_9,
+    KEY_6,
+    KEY_0,
+    KEY_8,
+    KEY_5,
+    KEYS
+};
+
+// time between keypad scans. Each scan reads one output, so the whole keypad is read
+// every 2 ms and a key has to read the same for four of those, 6 to 8 ms, to change
+#define KEY_SCAN_US 1000
+
+// ticks between moves while a direction key is held, and the least ticks between shots
+#define KEY_REPEAT_TICKS 50
+#define KEY_FIRE_TICKS 100
+
+// a key going down or up and the us clock at the scan that found it
+struct KeyEvent {
+    unsigned int time;
+    unsigned char key;
+    unsigned char pressed;
+};
+
+// key events, filled by keypadScan and emptied by keyDetect. Must be a power of two.
+// The interrupt cannot wait, so events that find the queue full are counted and dropped
+#define KEY_QUEUE_SIZE 16
+struct KeyEvent keyEvents[KEY_QUEUE_SIZE];
+volatile unsigned int keyEventHead = 0;
+volatile unsigned int keyEventTail = 0;
+int keyEventOverflows = 0;
+
+// debounced keys down, as a key mask
+volatile int keysDown = 0;
+
+// keypad output being driven, the keys read on KeyBitsOut[0] at its last scan, and the
+// vertical counters of the debounce. Bit n of keyCount0 and keyCount1 make up key n's
+// 2 bit count of scans in a row it has read differently from keysDown
+int keyScanColumn = 0;
+int keySample = 0;
+int keyCount0 = ~0;
+int keyCount1 = ~0;
+
+// longest keypadScan call seen, in cycles
+volatile unsigned int keyScanMaxCycles = 0;
+
+// keys keyDetect has seen go down and not come up, and presses it has not acted on yet
+int keysHeld = 0;
+int keysPressed = 0;
+
+// tick the player can next move on, and the tick of the last shot
+unsigned int keyLockUntil = 0;
+unsigned int keyLastFire = 0;
+
+// us clock at the last key press, and the us from the press the player last acted on
+// to the action
+unsigned int keyPressTime = 0;
+unsigned int keyLatencyUs = 0;
+
+// busy flag polling is turned on by InitializeLCD once the interface is configured,
+// and turned back off if the controller never answers
+int lcdBusyPollMode = 0;
+
+// number of busy flag polls that timed out
+int lcdBusyTimeouts = 0;
+
+// controllers the last command went to, and so where data goes (see LCD_CMD_SELECT)
+int lcdSelect = LCD_SELECT_ALL;
+
+// set to 1 to time the display driver at boot. The results are left in
+// lcdBenchCellsPerSec (set address and data for every cell) and lcdBenchRunCellsPerSec
+// (one set address, then all cells in DDRAM order). Build once with each LCD_BUS_4BIT
+// setting to compare the two interfaces on a board
+#ifndef LCD_BENCHMARK
+#define LCD_BENCHMARK 0
+#endif
+
+int lcdBenchCellsPerSec = 0;
+int lcdBenchRunCellsPerSec = 0;
+
+// LCD transmit queue, filled by the game and drained by TIMER1_IRQHandler
+unsigned short lcdQueue[LCD_QUEUE_SIZE];
+volatile unsigned int lcdQueueHead = 0;
+volatile unsigned int lcdQueueTail = 0;
+
+// set once Timer1 drains the queue, idle when the interrupt has nothing left to send
+int lcdQueueRunning = 0;
+volatile int lcdQueueIdle = 1;
+
+// in busy flag mode, set while the next entry waits on a busy controller, and the us
+// clock when the wait started
+int lcdQueueWaiting = 0;
+unsigned int lcdQueueWaitStart = 0;
+
+// deepest the queue has been, and the number of times the game had to wait on a full queue
+int lcdQueueHighWater = 0;
+int lcdQueueOverflows = 0;
+
+// length of a game tick in us. Every task period is a whole number of ticks
+#define TICK_US 1000
+
+// ticks since tickInitialize, raised by TIMER1_IRQHandler on MR2
+volatile unsigned int tickCount = 0;
+
+// the tick the game was last stepped to. It trails tickCount while runSimulation catches up
+unsigned int schedulerTick = 0;
+
+// stackless coroutines for sequences that span several ticks. A coroutine is a function
+// run from a task, its state is the line to carry on from and the tick a CO_DELAY ends on.
+// Locals do not survive a wait, so anything needed afterwards goes in a global.
+// CO_BEGIN and CO_END go around the body, a switch inside the body cannot hold a wait
+struct Coroutine {
+    unsigned short line;        // 0 until it has waited once, and again once it finishes
+    unsigned int wake;
+};
+
+#define CO_BEGIN(co) switch((co)->line) { case 0:
+#define CO_END(co) } (co)->line = 0
+#define CO_WAIT_UNTIL(co, cond) do { (co)->line = __LINE__; __attribute__((fallthrough)); \
+                                     case __LINE__: if(!(cond)) return; } while(0)
+#define CO_YIELD(co) do { (co)->line = __LINE__; return; case __LINE__:; } while(0)
+#define CO_DELAY(co, ticks) do { (co)->wake = schedulerTick + (ticks); \
+                                 CO_WAIT_UNTIL(co, (int)(schedulerTick - (co)->wake) >= 0); } while(0)
+
+// a game function run every period ticks. Its first run is phase ticks after schedulerStart,
+// so tasks with the same period can be kept off the same tick. inPlay tasks only run while
+// a game is being played. due is the next tick it runs on
+struct Task {
+    void (*run)(void);
+    unsigned short period;
+    unsigned short phase;
+    unsigned char inPlay;
+    unsigned int due;
+};
+
+// tasks in the order they run within a tick
+enum {
+    TASK_GAME_FLOW,
+    TASK_ANIMATE_STARS,
+    TASK_SCROLL_BACKGROUND,
+    TASK_KEY_DETECT,
+    TASK_MOVE_WEAPONS,
+    TASK_COLLISION_ANIMATION,
+    TASK_SPAWN_ENEMY,
+    TASK_MOVE_ENEMY,
+    TASK_ENEMY_FIRE,
+    TASK_FLASHES,
+    TASK_COUNT
+};
+
+struct Task tasks[TASK_COUNT] = {
+    [TASK_GAME_FLOW] = {gameFlow, 1, 0, 0},
+    [TASK_ANIMATE_STARS] = {animateStars, 175, 175, 1},
+    [TASK_SCROLL_BACKGROUND] = {scrollBackground, 525, 525, 1},
+    [TASK_KEY_DETECT] = {keyDetect, 1, 0, 0},
+    [TASK_MOVE_WEAPONS] = {moveWeapons, 35, 35, 1},
+    [TASK_COLLISION_ANIMATION] = {collisionAnimation, 200, 200, 1},
+    [TASK_SPAWN_ENEMY] = {spawnEnemy, 1, 1500, 1},          // spawnEnemy delays itself by each spawn's cooldown
+    [TASK_MOVE_ENEMY] = {moveEnemy, 250, 250, 1},
+    [TASK_ENEMY_FIRE] = {enemyFire, 150, 150, 1},
+    [TASK_FLASHES] = {runFlashes, 1, 0, 1},
+};
+
+// the title screen and game start sequence
+struct Coroutine gameFlowCo;
+
+// runs of a task that were dropped because the loop fell a whole period behind
+int tasksSkipped = 0;
+
+// most ticks runSimulation steps through in one go. When the loop falls further behind
+// than this, the oldest ticks are dropped rather than stalling the display to catch up
+#define SIM_MAX_CATCHUP 32
+
+// steps and frames since the current rate window started
+int simSteps = 0;
+int framesPresented = 0;
+unsigned int rateWindowStart = 0;
+
+// simulation steps and frames presented over the last whole second, and the total
+// number of steps dropped by the catch-up limit
+int simStepsPerSec = 0;
+int framesPerSec = 0;
+int simStepsDropped = 0;
+
+// sound engine frame length. Timer0 MR0 interrupts once a frame to step the voices,
+// the waveform itself comes from PWM1 and costs no interrupts
+#define SOUND_FRAME_US 1000
+
+// frames a voice keeps the piezo for before the next voice with a sound gets it. PWM1
+// only takes new match values at the end of a period, up to 5.2 ms for the lowest
+// tones, so a slice has to be well over that for each voice to be heard for several
+// whole periods. The outgoing voice always finishes the period it is in
+#define SOUND_SLICE_FRAMES 16
+
+// sound voices. Each can play at the same time as the others, the engine gives the
+// piezo to each voice with a sound in turn, one slice at a time
+enum {
+    VOICE_MUSIC,
+    VOICE_LASER,
+    VOICE_ENEMY_SHOT,
+    VOICE_EXPLOSION,
+    VOICES
+};
+
+// one step of a sound's envelope, already in PWM1 match values: the period and the high
+// time, which sets the duty, both in us, and how many frames the step lasts. A step of
+// 0 frames holds until the voice is changed. A period of 0 is a rest
+struct EnvelopeStep {
+    unsigned short periodUs;
+    unsigned short highUs;
+    unsigned char frames;
+};
+
+// a voice's current step (0 when it is silent), the steps after it and the frames left
+// of this one
+struct Voice {
+    const struct EnvelopeStep *step;
+    unsigned char stepsLeft;
+    unsigned char framesLeft;
+};
+volatile struct Voice voices[VOICES];
+
+// voice that has the piezo and the frames left of its slice, and the step PWM1 is playing
+int soundVoice = 0;
+int soundSliceLeft = 0;
+const struct EnvelopeStep *soundStep = 0;
+
+// sound interrupts (Timer0, and GPDMA in the SOUND_DAC build) and the cycles spent in
+// them since boot, and their rate and the share of the CPU they took over the last
+// whole second, in tenths of a percent
+volatile unsigned int soundIrqs = 0;
+volatile unsigned int soundIrqCycles = 0;
+unsigned int soundIrqsLast = 0;
+unsigned int soundIrqCyclesLast = 0;
+int soundIrqPerSec = 0;
+int soundLoadPermille = 0;
+
+// longest TIMER0_IRQHandler call seen, in cycles. The worst case works out at about 230
+// cycles, 58 us at the 4 MHz default clock: every voice moving to its next step on the
+// same frame (about 20 cycles each), the turn passing through every voice, a new PWM
+// step and a music note starting in the same call
+volatile unsigned int soundIrqMaxCycles = 0;
+
+// sound effects for soundPlay
+enum {
+    SFX_LASER,
+    SFX_ENEMY_SHOT,
+    SFX_EXPLOSION,
+    SFX_GAME_OVER,
+    SFX_COUNT
+};
+
+// sound effect envelopes, worked out ahead of time so the interrupt only steps through
+// them. Each step lasts 5 frames unless noted.
+// The laser starts at 1 kHz and drops 1% each period, like the original, so it ends
+// near 450 Hz after 110 ms
+const struct EnvelopeStep laserSteps[] = {
+    {1000, 500, 5}, {1051, 526, 5}, {1105, 552, 5}, {1161, 580, 5},
+    {1220, 610, 5}, {1282, 641, 5}, {1335, 667, 5}, {1389, 694, 5},
+    {1445, 723, 5}, {1504, 752, 5}, {1565, 782, 5}, {1628, 814, 5},
+    {1694, 847, 5}, {1746, 873, 5}, {1799, 899, 5}, {1853, 927, 5},
+    {1909, 955, 5}, {1967, 984, 5}, {2027, 1013, 5}, {2088, 1044, 5},
+    {2152, 1076, 5}, {2217, 1108, 5},
+};
+
+// enemy shots are a thin 25% duty chirp from 714 Hz down to 500 Hz over 40 ms
+const struct EnvelopeStep enemyShotSteps[] = {
+    {1400, 350, 5}, {1486, 371, 5}, {1571, 393, 5}, {1657, 414, 5},
+    {1743, 436, 5}, {1829, 457, 5}, {1914, 479, 5}, {2000, 500, 5},
+};
+
+// explosions jump between random periods around a falling pitch while the duty
+// thins from 50% to 12%, 150 ms in all
+const struct EnvelopeStep explosionSteps[] = {
+    {1967, 984, 5}, {1802, 878, 5}, {2574, 1219, 5}, {1814, 836, 5},
+    {2574, 1152, 5}, {2390, 1039, 5}, {1969, 830, 5}, {2772, 1132, 5},
+    {2052, 811, 5}, {2804, 1071, 5}, {2226, 821, 5}, {2324, 827, 5},
+    {3017, 1034, 5}, {3875, 1278, 5}, {2571, 814, 5}, {2835, 860, 5},
+    {3746, 1088, 5}, {4516, 1252, 5}, {3808, 1006, 5}, {3489, 876, 5},
+    {4886, 1162, 5}, {2824, 635, 5}, {4812, 1019, 5}, {3530, 701, 5},
+    {3241, 601, 5}, {3237, 558, 5}, {3788, 603, 5}, {5187, 758, 5},
+    {3589, 478, 5}, {4741, 569, 5},
+};
+
+// game over falls G4, E4, C4 with short rests between, the last note fading to 25% duty
+const struct EnvelopeStep gameOverSteps[] = {
+    {2551, 1276, 150}, {0, 0, 30}, {3034, 1517, 150}, {0, 0, 30},
+    {3822, 1911, 200}, {3822, 956, 200},
+};
+
+// each effect's envelope and the voice it plays on
+struct SoundEffect {
+    const struct EnvelopeStep *steps;
+    unsigned char count;
+    unsigned char voice;
+};
+
+#define SFX(steps, voice) {steps, sizeof(steps) / sizeof(steps[0]), voice}
+const struct SoundEffect soundEffects[SFX_COUNT] = {
+    [SFX_LASER] = SFX(laserSteps, VOICE_LASER),
+    [SFX_ENEMY_SHOT] = SFX(enemyShotSteps, VOICE_ENEMY_SHOT),
+    [SFX_EXPLOSION] = SFX(explosionSteps, VOICE_EXPLOSION),
+    [SFX_GAME_OVER] = SFX(gameOverSteps, VOICE_MUSIC),
+};
+
+#if SOUND_DAC
+// DAC sample rate and the samples in each DMA block. A block is 5 ms, the length of
+// most envelope steps, and the mixer runs once for each
+#define DAC_RATE_HZ 8000
+#define DAC_BLOCK 40
+#define DAC_SAMPLE_US (1000000 / DAC_RATE_HZ)
+
+// DAC value for silence, and how far a voice's square wave swings either side of it.
+// Samples swing up to 128 either way, so four voices fit in the 10 bit range
+#define DAC_MIDSCALE 512
+#define DAC_VOICE_LEVEL 96
+
+// GPDMA reads the address fields of a link as 32 bit words. The host build keeps whole
+// pointers in them for simDacRun, the channel registers only ever hold the low half there
+#ifdef HOST_SIM
+typedef unsigned long DmaAddress;
+#else
+typedef unsigned int DmaAddress;
+#endif
+
+// one link of a GPDMA transfer list, in the order the channel loads it
+struct DmaLink {
+    DmaAddress source;
+    DmaAddress destination;
+    DmaAddress next;
+    unsigned int control;
+};
+
+// two blocks of DACR words. The links point at each other so GPDMA plays the blocks in
+// turn forever, and dacHalf is the one the mixer fills next
+unsigned int dacBuffer[2][DAC_BLOCK];
+struct DmaLink dacLinks[2];
+volatile int dacHalf = 0;
+
+// blocks mixed since boot, and the longest DMA_IRQHandler call seen in cycles
+volatile unsigned int dacBlocks = 0;
+volatile unsigned int dacMixMaxCycles = 0;
+
+// sample formats, 8 bit unsigned PCM centered on 128 or 4 bit IMA ADPCM with the first
+// sample of each byte in the low nibble
+enum {
+    SAMPLE_PCM8,
+    SAMPLE_ADPCM4
+};
+
+// a sound sampled at DAC_RATE_HZ, kept in flash. length is in samples
+struct Sample {
+    const unsigned char *data;
+    unsigned short length;
+    unsigned char format;
+};
+
+// the sample a voice is playing (0 when it plays its envelope instead), how far through
+// it is and the ADPCM decoder state
+struct SampleChannel {
+    const struct Sample *sample;
+    unsigned short position;
+    unsigned char index;
+    short predictor;
+};
+volatile struct SampleChannel sampleChannels[VOICES];
+
+// where each voice's square wave is in its period, in us
+unsigned short dacPhase[VOICES];
+
+// IMA ADPCM step sizes, and the step index change for each code
+const unsigned short adpcmSteps[89] = {
+    7, 8, 9, 10, 11, 12, 13, 14, 16, 17, 19, 21,
+    23, 25, 28, 31, 34, 37, 41, 45, 50, 55, 60, 66,
+    73, 80, 88, 97, 107, 118, 130, 143, 157, 173, 190, 209,
+    230, 253, 279, 307, 337, 371, 408, 449, 494, 544, 598, 658,
+    724, 796, 876, 963, 1060, 1166, 1282, 1411, 1552, 1707, 1878, 2066,
+    2272, 2499, 2749, 3024, 3327, 3660, 4026, 4428, 4871, 5358, 5894, 6484,
+    7132, 7845, 8630, 9493, 10442, 11487, 12635, 13899, 15289, 16818, 18500, 20350,
+    22385, 24623, 27086, 29794, 32767,
+};
+const signed char adpcmIndexChange[8] = {-1, -1, -1, -1, 2, 4, 6, 8};
+
+// 60 ms laser zap, a sweep from 1.8 kHz down to 500 Hz with a third harmonic, fading out
+const unsigned char laserPcm[] = {
+    0xB3, 0xAD, 0x41, 0x3B, 0xC7, 0xC2, 0x4C, 0x4D, 0x83, 0xB2, 0xB0, 0x40, 0x3B, 0xC2, 0xB9, 0x66,
+    0x51, 0x5D, 0xBC, 0xC3, 0x3F, 0x48, 0x97, 0xAE, 0xAA, 0x42, 0x3E, 0xB9, 0xB1, 0x84, 0x4E, 0x44,
+    0xC1, 0xB8, 0x68, 0x54, 0x51, 0xBE, 0xBC, 0x5A, 0x55, 0x5A, 0xBC, 0xBC, 0x57, 0x56, 0x5B, 0xBB,
+    0xBB, 0x5D, 0x56, 0x54, 0xBC, 0xB6, 0x6C, 0x55, 0x4A, 0xBA, 0xAE, 0x87, 0x4E, 0x45, 0xAC, 0xA8,
+    0xA7, 0x47, 0x4E, 0x88, 0xAD, 0xB9, 0x52, 0x59, 0x5A, 0xB8, 0xAF, 0x81, 0x51, 0x49, 0xA1, 0xA6,
+    0xB2, 0x4D, 0x5A, 0x61, 0xB5, 0xAD, 0x86, 0x50, 0x4D, 0x92, 0xA9, 0xB4, 0x5D, 0x5C, 0x4F, 0xAD,
+    0xA3, 0xAA, 0x4F, 0x5C, 0x5F, 0xB2, 0xA5, 0x99, 0x4E, 0x59, 0x6D, 0xB0, 0xA8, 0x8F, 0x51, 0x58,
+    0x72, 0xAF, 0xA7, 0x8F, 0x51, 0x5A, 0x6E, 0xAF, 0xA4, 0x97, 0x52, 0x5E, 0x62, 0xAD, 0xA0, 0xA5,
+    0x56, 0x61, 0x56, 0xA2, 0x9F, 0xAC, 0x6A, 0x5D, 0x56, 0x85, 0xA8, 0xA5, 0x8E, 0x55, 0x61, 0x61,
+    0xA7, 0x9D, 0xA9, 0x67, 0x60, 0x58, 0x80, 0xA7, 0xA0, 0x99, 0x59, 0x65, 0x59, 0x97, 0xA0, 0xA5,
+    0x87, 0x59, 0x64, 0x60, 0x9F, 0x9C, 0xA5, 0x7E, 0x5C, 0x64, 0x63, 0x9F, 0x9B, 0xA4, 0x7F, 0x5C,
+    0x66, 0x61, 0x9B, 0x9B, 0xA1, 0x89, 0x5D, 0x68, 0x5E, 0x8F, 0x9F, 0x9C, 0x98, 0x63, 0x67, 0x60,
+    0x79, 0xA1, 0x97, 0xA1, 0x78, 0x61, 0x68, 0x63, 0x94, 0x9B, 0x9A, 0x96, 0x66, 0x68, 0x64, 0x71,
+    0x9D, 0x96, 0x9D, 0x89, 0x63, 0x6B, 0x63, 0x7B, 0x9D, 0x94, 0x9D, 0x84, 0x63, 0x6C, 0x64, 0x7C,
+    0x9C, 0x93, 0x9B, 0x87, 0x65, 0x6D, 0x66, 0x75, 0x99, 0x94, 0x98, 0x90, 0x6B, 0x6B, 0x6B, 0x6B,
+    0x8F, 0x97, 0x92, 0x98, 0x7A, 0x68, 0x6F, 0x68, 0x7B, 0x97, 0x91, 0x95, 0x8F, 0x6F, 0x6C, 0x6F,
+    0x6A, 0x85, 0x97, 0x8F, 0x96, 0x8A, 0x6D, 0x6E, 0x6F, 0x6C, 0x86, 0x95, 0x8E, 0x94, 0x8A, 0x6F,
+    0x6E, 0x71, 0x6C, 0x81, 0x94, 0x8E, 0x91, 0x8F, 0x76, 0x6D, 0x73, 0x6D, 0x77, 0x8F, 0x90, 0x8D,
+    0x92, 0x83, 0x6F, 0x72, 0x72, 0x6F, 0x81, 0x91, 0x8D, 0x8E, 0x8F, 0x7D, 0x70, 0x74, 0x72, 0x72,
+    0x83, 0x90, 0x8B, 0x8D, 0x8E, 0x7E, 0x71, 0x75, 0x74, 0x72, 0x80, 0x8E, 0x8B, 0x8B, 0x8E, 0x83,
+    0x74, 0x74, 0x77, 0x73, 0x79, 0x89, 0x8D, 0x89, 0x8C, 0x8A, 0x7C, 0x74, 0x77, 0x76, 0x74, 0x7E,
+    0x8A, 0x8A, 0x88, 0x8B, 0x88, 0x7B, 0x75, 0x78, 0x77, 0x75, 0x7D, 0x89, 0x8A, 0x87, 0x89, 0x88,
+    0x7E, 0x77, 0x78, 0x79, 0x77, 0x7A, 0x84, 0x89, 0x87, 0x87, 0x89, 0x84, 0x7B, 0x78, 0x7A, 0x79,
+    0x78, 0x7D, 0x85, 0x88, 0x85, 0x86, 0x87, 0x83, 0x7B, 0x79, 0x7B, 0x7B, 0x79, 0x7D, 0x84, 0x87,
+    0x85, 0x85, 0x86, 0x84, 0x7E, 0x7A, 0x7B, 0x7C, 0x7B, 0x7B, 0x80, 0x85, 0x85, 0x84, 0x84, 0x85,
+    0x82, 0x7D, 0x7B, 0x7C, 0x7D, 0x7C, 0x7D, 0x80, 0x84, 0x84, 0x83, 0x83, 0x84, 0x82, 0x7E, 0x7C,
+    0x7D, 0x7E, 0x7D, 0x7D, 0x7F, 0x82, 0x83, 0x82, 0x82, 0x83, 0x82, 0x81, 0x7E, 0x7E, 0x7E, 0x7E,
+    0x7E, 0x7E, 0x7F, 0x81, 0x82, 0x82, 0x81, 0x82, 0x82, 0x81, 0x7F, 0x7E, 0x7F, 0x7F, 0x7F, 0x7F,
+    0x7F, 0x80, 0x81, 0x81, 0x81, 0x81, 0x81, 0x81, 0x80, 0x7F, 0x7F, 0x7F, 0x80, 0x80, 0x7F, 0x80,
+    0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80,
+};
+const struct Sample laserSample = {laserPcm, sizeof(laserPcm), SAMPLE_PCM8};
+
+// 250 ms explosion, low passed noise that darkens as it dies away
+const unsigned char explosionAdpcm[] = {
+    0xF0, 0xFF, 0xFF, 0xFF, 0xDF, 0xBB, 0x72, 0xA8, 0x73, 0x92, 0xD4, 0x91, 0xCB, 0x58, 0x19, 0x92,
+    0xD0, 0x0A, 0x20, 0x28, 0xB1, 0x37, 0x8B, 0x60, 0xB1, 0xD3, 0x19, 0x8A, 0x2C, 0x14, 0xA2, 0x00,
+    0xA8, 0x24, 0x80, 0x9F, 0x41, 0x90, 0x0B, 0x8E, 0x89, 0x00, 0x09, 0x78, 0x89, 0x41, 0x02, 0xB9,
+    0x4A, 0xC3, 0x9C, 0x09, 0x93, 0x0B, 0x30, 0x37, 0x88, 0xE0, 0x12, 0x01, 0xA9, 0x0E, 0x8A, 0x08,
+    0x88, 0x80, 0x08, 0x38, 0x97, 0x8A, 0xA0, 0x47, 0x90, 0xBB, 0x08, 0x94, 0x5A, 0xA1, 0xB0, 0x70,
+    0x02, 0x9A, 0x2B, 0x21, 0xBA, 0x73, 0x01, 0x00, 0xAB, 0xFA, 0x09, 0x28, 0x05, 0x12, 0x00, 0xBD,
+    0xA9, 0x62, 0x82, 0x18, 0x0C, 0x12, 0x90, 0x0D, 0x29, 0x94, 0x2A, 0xD1, 0xBB, 0x34, 0x2A, 0x04,
+    0x8B, 0xBD, 0x14, 0x30, 0x19, 0xD2, 0xAB, 0x19, 0x88, 0x7A, 0x80, 0x31, 0x28, 0xA8, 0xF9, 0x99,
+    0x4B, 0x08, 0x23, 0x89, 0x41, 0x0D, 0x9A, 0x13, 0x41, 0x94, 0x99, 0x19, 0x89, 0x7A, 0x22, 0xC1,
+    0x2A, 0xF3, 0x8C, 0x8A, 0x29, 0x35, 0x0A, 0xB1, 0x52, 0x1A, 0x99, 0x33, 0xAE, 0x98, 0x9A, 0xB4,
+    0x11, 0x8C, 0x13, 0x7B, 0x23, 0xCB, 0x2B, 0xB8, 0x70, 0x92, 0x2A, 0x10, 0xBC, 0x01, 0x6B, 0x21,
+    0x1B, 0x2B, 0xA0, 0x60, 0xBA, 0x98, 0x9C, 0x8A, 0x11, 0x17, 0x90, 0xB9, 0xB8, 0x27, 0x19, 0xA4,
+    0x02, 0x28, 0x89, 0x61, 0x09, 0x81, 0xCB, 0xBD, 0x4A, 0x90, 0x5A, 0x14, 0xA9, 0x09, 0x0A, 0x68,
+    0x04, 0x1A, 0xA9, 0x8C, 0x10, 0x19, 0x9C, 0x19, 0xAA, 0x01, 0x27, 0x24, 0x21, 0xBA, 0xC4, 0x01,
+    0x2D, 0x02, 0x11, 0x9D, 0x28, 0x22, 0x18, 0x88, 0xDF, 0x8A, 0x39, 0x22, 0x11, 0xF8, 0x11, 0x80,
+    0xC0, 0x91, 0x8C, 0x82, 0x53, 0x90, 0x19, 0x02, 0xF0, 0x9B, 0x02, 0xC1, 0x8B, 0x34, 0x93, 0x88,
+    0xD0, 0x93, 0x45, 0xAB, 0x42, 0xB8, 0x3C, 0x0A, 0x0B, 0x96, 0x01, 0x12, 0x2B, 0xF9, 0x0C, 0x80,
+    0x09, 0x40, 0x2A, 0x94, 0x22, 0xB3, 0xAC, 0x05, 0xA9, 0xDA, 0x4A, 0x48, 0x98, 0x98, 0x58, 0x23,
+    0x28, 0x91, 0xF9, 0x88, 0x10, 0xDA, 0xA2, 0x90, 0x38, 0x96, 0x90, 0x88, 0xBB, 0x7A, 0x91, 0x43,
+    0xB8, 0xCB, 0x98, 0x08, 0x72, 0x82, 0x88, 0x98, 0x9C, 0x85, 0x28, 0x92, 0xBA, 0x18, 0x27, 0xC2,
+    0x0B, 0x03, 0xC8, 0x39, 0x24, 0xC3, 0xBC, 0x28, 0x14, 0x10, 0x99, 0x0F, 0x28, 0x90, 0xBB, 0x32,
+    0xDB, 0x20, 0xA1, 0xD2, 0x19, 0x17, 0x83, 0xBB, 0x14, 0xD9, 0x18, 0x90, 0x41, 0xC9, 0x09, 0x92,
+    0x33, 0xC0, 0x94, 0xB2, 0x2C, 0x59, 0xB0, 0x9B, 0x73, 0x99, 0x4A, 0xB9, 0x0B, 0x45, 0x21, 0xA2,
+    0x1D, 0xB0, 0x90, 0x99, 0xCB, 0x08, 0x87, 0x93, 0x28, 0x82, 0x8D, 0x38, 0x99, 0xC3, 0x38, 0xD3,
+    0xBC, 0x04, 0x32, 0xA8, 0x13, 0x1B, 0xCB, 0x1E, 0x15, 0xB2, 0x8B, 0x53, 0xB8, 0x89, 0xA4, 0x21,
+    0x22, 0xD8, 0xAB, 0xD2, 0x2A, 0xB9, 0x1D, 0x61, 0x33, 0xD9, 0x8A, 0x02, 0x99, 0x22, 0x43, 0xD0,
+    0xA1, 0x98, 0xB2, 0xBB, 0x6C, 0x81, 0x58, 0xA0, 0x02, 0xB4, 0x19, 0x33, 0xBE, 0xAB, 0x24, 0x83,
+    0x92, 0x1C, 0xB4, 0x09, 0xAB, 0xAD, 0x39, 0x94, 0x8C, 0x93, 0x98, 0x26, 0xBB, 0x38, 0xA4, 0x3B,
+    0x91, 0x79, 0x01, 0x98, 0x45, 0xB8, 0xA0, 0x2E, 0x20, 0x38, 0xC8, 0x0D, 0x31, 0x0A, 0x88, 0xAB,
+    0x71, 0x89, 0x43, 0xC9, 0x32, 0xD0, 0x81, 0x11, 0xB1, 0xC0, 0x3A, 0xB4, 0x9C, 0x80, 0xAB, 0x64,
+    0x0A, 0xB2, 0xB3, 0x10, 0x92, 0x19, 0x38, 0x98, 0x9F, 0xA0, 0x45, 0xB0, 0xC9, 0x8B, 0x1A, 0xB3,
+    0xA4, 0x55, 0xB1, 0x88, 0x95, 0x52, 0x11, 0x1B, 0x28, 0xE3, 0x28, 0xAC, 0xA0, 0x92, 0xC2, 0x48,
+    0xAA, 0x98, 0xAD, 0x59, 0x43, 0x19, 0x8A, 0x80, 0x13, 0x40, 0x2C, 0xA1, 0xC2, 0x03, 0x1B, 0xFA,
+    0xB0, 0xA2, 0x62, 0x01, 0xEA, 0xAB, 0x11, 0x51, 0x99, 0xA0, 0x8C, 0x09, 0x30, 0x84, 0x12, 0x6B,
+    0xA8, 0x1C, 0x25, 0xA0, 0x0C, 0x81, 0x82, 0x15, 0x29, 0x9C, 0xA8, 0x2C, 0x1B, 0x96, 0x09, 0x21,
+    0xA3, 0xAB, 0x3E, 0x33, 0x2C, 0x82, 0x92, 0xCD, 0xBA, 0x49, 0x34, 0x92, 0x98, 0x02, 0x0B, 0xA6,
+    0xC2, 0xBB, 0x62, 0x82, 0x91, 0x2B, 0x21, 0x60, 0x19, 0x20, 0x8B, 0xE9, 0x8C, 0x2B, 0xD9, 0x4B,
+    0x90, 0xBB, 0x43, 0x24, 0x0A, 0x38, 0x44, 0x1B, 0x33, 0xCD, 0xCB, 0x31, 0x22, 0xA1, 0xBD, 0x80,
+    0x89, 0x9B, 0x59, 0x01, 0x16, 0x12, 0x9C, 0x28, 0x18, 0xB0, 0xC4, 0xA2, 0xAE, 0x52, 0x89, 0x20,
+    0x89, 0x28, 0x59, 0xA9, 0x01, 0x0C, 0x3B, 0x34, 0xA2, 0xAA, 0xC5, 0xB2, 0xAC, 0x14, 0x48, 0x89,
+    0x38, 0x13, 0xCA, 0x1E, 0x22, 0x9B, 0x12, 0x9D, 0x94, 0xAB, 0x52, 0xC9, 0x99, 0xA1, 0xA8, 0x37,
+    0x39, 0x9A, 0x25, 0x92, 0x8B, 0xBC, 0xC9, 0x48, 0x13, 0x01, 0x0B, 0x49, 0x05, 0x10, 0xC9, 0x40,
+    0x12, 0x12, 0xB8, 0x8F, 0x9C, 0x21, 0xA1, 0x9A, 0x81, 0x72, 0x0A, 0x92, 0x59, 0x9B, 0x1C, 0x14,
+    0x8C, 0x10, 0x10, 0x02, 0x4A, 0x0B, 0x2B, 0x3E, 0xE9, 0x8A, 0x8B, 0x30, 0x90, 0x4A, 0x17, 0x19,
+    0xA8, 0x2B, 0x24, 0x08, 0x4B, 0x08, 0x34, 0xC9, 0xD9, 0x81, 0x92, 0xBA, 0xBA, 0x1F, 0x98, 0x18,
+    0x31, 0x05, 0x44, 0x1A, 0x33, 0x0C, 0xD0, 0x1D, 0x91, 0xBA, 0x3A, 0xA0, 0x35, 0x28, 0x32, 0x42,
+    0x32, 0x8E, 0x09, 0x29, 0xC8, 0xBD, 0xB9, 0xB8, 0x20, 0x72, 0x29, 0x10, 0x41, 0x98, 0xC3, 0x18,
+    0x8D, 0x41, 0x38, 0x80, 0xE2, 0x08, 0x29, 0x99, 0x28, 0xBB, 0x8A, 0x97, 0x83, 0xB9, 0x79, 0x22,
+    0xC9, 0x8A, 0x40, 0x0C, 0x13, 0xAD, 0xAC, 0x22, 0x33, 0x15, 0x80, 0x81, 0xC0, 0xA8, 0xE2, 0xCB,
+    0x40, 0x01, 0x21, 0xB1, 0x9C, 0x9A, 0x61, 0x0A, 0xBC, 0x22, 0x14, 0x9C, 0x40, 0x04, 0xB8, 0xA8,
+    0xCC, 0x0A, 0x48, 0x38, 0xB9, 0x92, 0x94, 0x3B, 0x64, 0xA2, 0x10, 0x30, 0x4A, 0xD2, 0x8D, 0xA2,
+    0x19, 0x29, 0xB0, 0x1A, 0x30, 0x3C, 0x20, 0x83, 0x5A, 0x27, 0xB1, 0x1D, 0x21, 0x09, 0x33, 0xC0,
+    0x2B, 0x0A, 0x40, 0xB4, 0xCF, 0x09, 0x22, 0x1A, 0x42, 0xA0, 0x11, 0x41, 0xFA, 0x19, 0x0A, 0xA3,
+    0x00, 0xC9, 0x1B, 0x03, 0x1E, 0xA2, 0x40, 0x13, 0x89, 0xCD, 0x0C, 0x08, 0x00, 0xDB, 0x03, 0x0A,
+    0x94, 0x91, 0xC0, 0x3D, 0x14, 0x91, 0x01, 0x24, 0x43, 0xE9, 0xAB, 0xBB, 0x48, 0x41, 0x93, 0x88,
+    0x2C, 0x08, 0x41, 0x82, 0xC9, 0x52, 0xC9, 0xAA, 0x42, 0xA3, 0x20, 0x50, 0xCB, 0x20, 0xA2, 0x18,
+    0xBC, 0xEB, 0xA8, 0xB9, 0xB2, 0x83, 0x4D, 0x40, 0x34, 0x89, 0x2B, 0x23, 0xA0, 0x02, 0xE0, 0xEB,
+    0x00, 0x29, 0x88, 0xAB, 0x03, 0x8B, 0x79, 0x48, 0x29, 0xA3, 0xA8, 0xBC, 0x7A, 0x34, 0xA8, 0xA1,
+    0x90, 0xB4, 0x81, 0xDC, 0x01, 0x89, 0x83, 0xB1, 0x2D, 0x93, 0xBD, 0x10, 0xA8, 0x51, 0x24, 0xB9,
+    0x81, 0xB3, 0x83, 0x46, 0xC1, 0x82, 0x93, 0x1B, 0xC9, 0x0A, 0x8E, 0x08, 0x2A, 0x45, 0x10, 0x18,
+    0x2B, 0x15, 0x88, 0xE8, 0x91, 0xDA, 0x2A, 0xBA, 0x91, 0x0C, 0x22, 0x93, 0x44, 0xBA, 0x09, 0xC9,
+    0xB8, 0x71, 0x18, 0x93, 0x63, 0x00, 0x02, 0x38, 0x94, 0xBB, 0x49, 0x44, 0x32, 0x9C, 0x32, 0xBA,
+    0xB8, 0xF9, 0x9A, 0xBC, 0x32, 0x15, 0x32, 0xB3,
+};
+const struct Sample explosionSample = {explosionAdpcm, sizeof(explosionAdpcm) * 2, SAMPLE_ADPCM4};
+
+// sampled version of each effect, effects without one play their envelope
+const struct Sample *const effectSamples[SFX_COUNT] = {
+    [SFX_LASER] = &laserSample,
+    [SFX_EXPLOSION] = &explosionSample,
+};
+#endif
 
 // Flag to determine if title screen should be displayed
 int titleScreenFlag;
 
-// Flag to determine when to play lazer beep
-int soundFlag = -1;
-
-// moveWeapons function will only run if this is greater than zero
-int collisionsOnScreen = 0;
-
 // character codes for display on screen
 int blank = 0x20;
-int ships[10] = {0x00, 0x01, 0x3C, 0xB4, 0xCC, 0xF6, 0x28, 0xD3, 0xE0, 0xE5}; // ship characters, player ship is position 0,1
-int weapons[3] = {0x3D, 0x10, 0xAA};
-int star1[2] = {0xA1, 0x2C};
-int star2[2] = {0xDF, 0xDE};
-int star3[2] = {0x2C, 0x2E};
-int collisionArr[3] = {0xA5, 0xDB, 0x2A};
-
-// collision animation at display position
-int collisionAnimAtPos[2][10];
 
-// enemy locations and fire countdown for individual ships
-int enemyPosFire[2][4];
+// sprite numbers. Ships take two, the rear (left) character and then the front
+#define SPRITE_PLAYER 0
+#define SPRITE_ENEMY1 2
+#define SPRITE_ENEMY2 4
+#define SPRITE_ENEMY3 6
+#define SPRITE_ENEMY4 8
+#define SPRITE_DOUBLE_BLAST 10
+#define SPRITE_SPECIAL_BLAST 11
+#define SPRITE_ENEMY_BLAST 12
+#define SPRITE_COLLISION 13     // three animation frames
+#define SPRITE_STAR1A 16
+#define SPRITE_STAR1B 17
+#define SPRITE_STAR2A 18
+#define SPRITE_STAR2B 19
+#define SPRITE_STAR3A 20
+#define SPRITE_STAR3B 21
+#define SPRITE_BLANK 22
+#define SPRITE_COUNT 23
+
+// stars twinkle every 175 ms and would keep the CGRAM slots churning, so they and the
+// blank are always drawn from the ROM character set
+#define SPRITE_FIRST_ROM_ONLY SPRITE_STAR1A
+
+// ROM character used for each sprite when it is not loaded in CGRAM
+const unsigned char spriteRomChars[SPRITE_COUNT] = {
+    0x2D, 0x3E,                         // player
+    0x3C, 0xB4, 0xCC, 0xF6,             // enemy 1, 2
+    0x28, 0xD3, 0xE0, 0xE5,             // enemy 3, 4
+    0x3D, 0x10, 0xAA,                   // double, special and enemy blast
+    0xA5, 0xDB, 0x2A,                   // collision frames
+    0xA1, 0x2C, 0xDF, 0xDE, 0x2C, 0x2E, // stars
+    0x20                                // blank
+};
+
+// 5x8 bitmaps for every sprite, top row first
+const unsigned char spriteBitmaps[SPRITE_COUNT][8] = {
+    {0b11100, 0b01110, 0b00111, 0b00010, 0b00010, 0b00111, 0b01110, 0b11100},   // player rear
+    {0b00000, 0b11100, 0b11000, 0b10111, 0b10111, 0b11000, 0b11100, 0b00000},   // player front
+    {0b00000, 0b00011, 0b00110, 0b11111, 0b11111, 0b00110, 0b00011, 0b00000},   // enemy 1
+    {0b00000, 0b11000, 0b01110, 0b11111, 0b11111, 0b01110, 0b11000, 0b00000},
+    {0b00000, 0b00001, 0b00111, 0b01101, 0b11111, 0b00111, 0b00001, 0b00000},   // enemy 2
+    {0b00000, 0b10000, 0b11100, 0b10110, 0b11111, 0b11100, 0b10000, 0b00000},
+    {0b00111, 0b01100, 0b11000, 0b11111, 0b11111, 0b11000, 0b01100, 0b00111},   // enemy 3
+    {0b10001, 0b11011, 0b01110, 0b11111, 0b11111, 0b01110, 0b11011, 0b10001},
+    {0b00000, 0b00111, 0b01111, 0b11101, 0b11111, 0b01111, 0b00111, 0b00000},   // enemy 4
+    {0b11111, 0b11110, 0b11100, 0b11111, 0b11111, 0b11100, 0b11110, 0b11111},
+    {0b00000, 0b00000, 0b01111, 0b00000, 0b00000, 0b01111, 0b00000, 0b00000},   // double blast
+    {0b00000, 0b00100, 0b01110, 0b11111, 0b01110, 0b00100, 0b00000, 0b00000},   // special blast
+    {0b00000, 0b00000, 0b00110, 0b11111, 0b00110, 0b00000, 0b00000, 0b00000},   // enemy blast
+    {0b00000, 0b00000, 0b01010, 0b00100, 0b01010, 0b00000, 0b00000, 0b00000},   // collision frames
+    {0b10001, 0b01010, 0b00100, 0b11111, 0b00100, 0b01010, 0b10001, 0b00000},
+    {0b10101, 0b00000, 0b10001, 0b00000, 0b10001, 0b00000, 0b10101, 0b00000},
+    {0b00000, 0b00000, 0b00100, 0b01110, 0b00100, 0b00000, 0b00000, 0b00000},   // stars
+    {0b00000, 0b00000, 0b00000, 0b00100, 0b00000, 0b00000, 0b00000, 0b00000},
+    {0b00000, 0b00100, 0b10101, 0b01110, 0b10101, 0b00100, 0b00000, 0b00000},
+    {0b00000, 0b00000, 0b01010, 0b00100, 0b01010, 0b00000, 0b00000, 0b00000},
+    {0b00000, 0b00000, 0b00000, 0b00000, 0b00000, 0b00010, 0b00000, 0b00000},
+    {0b00000, 0b00000, 0b00000, 0b00000, 0b00000, 0b00000, 0b01000, 0b00000},
+    {0b00000, 0b00000, 0b00000, 0b00000, 0b00000, 0b00000, 0b00000, 0b00000}    // blank
+};
+
+// CGRAM slot contents: the sprite loaded (-1 for none), how many display locations are
+// showing it and when it was last asked for. Slots still on screen are never evicted
+int cgramSprite[8] = {-1, -1, -1, -1, -1, -1, -1, -1};
+int cgramRefs[8];
+unsigned int cgramLastUse[8];
+unsigned int cgramClock = 0;
+
+// sprite cache statistics. Every upload is 9 transfers, the set CGRAM address
+// command and 8 bytes
+int cgramHits = 0;
+int cgramMisses = 0;
+int cgramByteWrites = 0;
+
+// character currently shown at each display location, and the sprite it came from
+unsigned char displayChars[LCD_CELLS];
+unsigned char displaySprites[LCD_CELLS];
+
+// draw order for each sprite: 0 is the player and collisions, 1 weapons and enemies,
+// 2 the background
+#define RENDER_PRIORITIES 3
+const unsigned char spritePriority[SPRITE_COUNT] = {
+    0, 0,                               // player
+    1, 1, 1, 1, 1, 1, 1, 1,             // enemies
+    1, 1, 1,                            // weapons
+    0, 0, 0,                            // collision frames
+    2, 2, 2, 2, 2, 2,                   // stars
+    2                                   // blank
+};
+
+// bus time in us writeDisplay may use per frame, including transfers still queued from
+// earlier frames. Locations that do not fit stay dirty for the next frame
+int renderBudgetUs = 2000;
+
+// dirty locations the last frame left for later because they did not fit in
+// renderBudgetUs, and the running total
+int renderDeferredCells = 0;
+int renderDeferredTotal = 0;
+
+// most bus time one frame queued, and the longest writeDisplay call, both in us
+int renderWorstBusUs = 0;
+int renderWorstFrameUs = 0;
+
+// how many of each kind of entity can be on screen at once
+#ifndef PLAYER_WEAPON_MAX
+#define PLAYER_WEAPON_MAX 20
+#endif
+#ifndef ENEMY_WEAPON_MAX
+#define ENEMY_WEAPON_MAX 10
+#endif
+#ifndef ENEMY_MAX
+#define ENEMY_MAX 4
+#endif
+#ifndef COLLISION_MAX
+#define COLLISION_MAX 10
+#endif
+
+// fixed size pool of entity slots. Live slots are packed at the front of active so
+// updates only visit entities that exist, and free slots are chained through link
+// so taking or returning one is constant time. For a live slot link holds its
+// index in active, for a free slot the next free slot or -1
+struct EntityPool {
+    short *active;
+    short *link;
+    short capacity;
+    short count;
+    short freeHead;
+};
+
+#define ENTITY_POOL(name, cap) \
+    short name##Active[cap]; \
+    short name##Link[cap]; \
+    struct EntityPool name = {name##Active, name##Link, cap, 0, -1}
+
+// takes a free slot and adds it to the active list, -1 when the pool is full
+int poolAlloc(struct EntityPool *);
+
+// returns a live slot to the free list. The last active slot moves into its place,
+// so loops that free while walking active must walk it from the back
+void poolFree(struct EntityPool *, int);
+
+// frees every slot
+void poolReset(struct EntityPool *);
+
+// collision animation at display position, indexed by collisionPool slot
+int collisionAnimAtPos[2][COLLISION_MAX];
+ENTITY_POOL(collisionPool, COLLISION_MAX);
+
+// enemy locations and fire countdown for individual ships, indexed by enemyPool slot
+int enemyPosFire[2][ENEMY_MAX];
+ENTITY_POOL(enemyPool, ENEMY_MAX);
 
 // positions of weapons and player on screen
-int weaponPositions[20];
-int enemyWeaponPos[10];
+int weaponPositions[PLAYER_WEAPON_MAX];
+int enemyWeaponPos[ENEMY_WEAPON_MAX];
+ENTITY_POOL(weaponPool, PLAYER_WEAPON_MAX);
+ENTITY_POOL(enemyWeaponPool, ENEMY_WEAPON_MAX);
 int playerPosition[2];
 
-// initial starting positions of stars and types at each location on display
+// explosion flashes, the locations covered and each flash's coroutine, indexed by flashPool
+// slot. A flash shows for FLASH_TICKS while the game carries on
+#ifndef FLASH_MAX
+#define FLASH_MAX 4
+#endif
+#define FLASH_TICKS 50
+int flashAt[2][FLASH_MAX];
+struct Coroutine flashCo[FLASH_MAX];
+ENTITY_POOL(flashPool, FLASH_MAX);
+
+// where the rear of the player's ship starts, the beginning of line 1
+#define PLAYER_START LCD_COLS
+
+// frees the weapons in a pool that are at a location and clears them from the gameMap
+void removeShotsAt(struct EntityPool *, int *, int);
+
+// which cells each kind of entity covers, one RowBits per display line with bit n for
+// column n. Rebuilt from the pools every loop by buildOccupancy for resolveCollisions,
+// their only reader, so finding collisions costs a few mask operations per line however
+// many entities there are. spawnEnemy reads the gameMap instead, see spawnCellFree
+RowBits playerShotRows[LCD_ROWS];
+RowBits enemyShotRows[LCD_ROWS];
+RowBits enemyRows[LCD_ROWS];
+RowBits playerRows[LCD_ROWS];
+
+// sets width bits in an occupancy mask starting at a location
+#define OCCUPY(rows, location, width) \
+    ((rows)[LOCATION_ROW(location)] |= (ROW_BIT(width) - 1) << LOCATION_COLUMN(location))
+
+// what spawnEnemy can put on screen. Each entry is where the enemy's rear goes (the
+// front is the next location), which enemy it is and how many loops to wait before
+// the next spawn
+struct SpawnEntry {
+    unsigned char location;
+    unsigned char ship;
+    unsigned short cooldown;
+};
+
+// spawnEnemy picks with a random number below this, a power of two
+#define SPAWN_WEIGHT_TOTAL 16
+
+// each enemy type enters at the right edge of a line with the same chance, SPAWN_WEIGHT
+// out of SPAWN_WEIGHT_TOTAL
+#define SPAWN_WEIGHT (SPAWN_WEIGHT_TOTAL / (4 * LCD_ROWS))
+#define SPAWN_LINE(r) \
+    {(r) * LCD_COLS + LCD_COLS - 2, enemy1, 1500}, \
+    {(r) * LCD_COLS + LCD_COLS - 2, enemy2, 1500}, \
+    {(r) * LCD_COLS + LCD_COLS - 2, enemy3, 1500}, \
+    {(r) * LCD_COLS + LCD_COLS - 2, enemy4, 1500}
+
+const struct SpawnEntry spawnTable[] = {
+    SPAWN_LINE(0), SPAWN_LINE(1),
+#if LCD_ROWS > 2
+    SPAWN_LINE(2), SPAWN_LINE(3),
+#endif
+};
+
+#define SPAWN_ENTRIES (sizeof(spawnTable) / sizeof(spawnTable[0]))
+
+// spawnTable entry for each value of a random number below SPAWN_WEIGHT_TOTAL, each entry
+// taking SPAWN_WEIGHT values in a row, so picking an entry is a single lookup. Written
+// out for a SPAWN_WEIGHT_TOTAL of 16
+#define SPAWN_PICKS4(v) (v) / SPAWN_WEIGHT, ((v) + 1) / SPAWN_WEIGHT, \
+                        ((v) + 2) / SPAWN_WEIGHT, ((v) + 3) / SPAWN_WEIGHT
+const unsigned char spawnPicks[SPAWN_WEIGHT_TOTAL] = {
+    SPAWN_PICKS4(0), SPAWN_PICKS4(4), SPAWN_PICKS4(8), SPAWN_PICKS4(12)
+};
+
+// true when nothing that would stop an enemy appearing covers a location and the next one
+int spawnCellFree(int);
+
+// initial starting positions of stars and types, laid out for 20 columns by 4 lines.
+// Wider panels repeat the pattern every 20 columns, smaller ones leave out what is off screen
 int starPositions[14] = {0, 6, 14, 24, 30, 38, 41, 47, 52, 57, 64,
                          68, 74, 78};
 int starTypes[14] = {star1A, star2B, star3A, star2B, star1A, star2B, star2A,
                      star3B, star1A, star2B, star2A, star3B, star2A, star3B};
 
+// the star field as bitplanes, one RowBits per display line with bit n for column n. A star's
+// gameMap value is its type (1 to 3) shifted up one with the twinkle phase in the low bit,
+// so starTypeLow and starTypeHigh are bits 1 and 2 of it and starPhase is bit 0. The planes
+// are what moves, the gameMap star bits are kept in step by syncStars
+RowBits starPresent[LCD_ROWS];
+RowBits starTypeLow[LCD_ROWS];
+RowBits starTypeHigh[LCD_ROWS];
+RowBits starPhase[LCD_ROWS];
+
+// moves every column of a line one to the left, column 0 wrapping round to the last column
+#define ROW_ROTATE(x) (((x) >> 1) | (((x) & 1) << LAST_COLUMN))
+
 // title screen positions and characters
-int titleScreenPositions[2] = {22, 42};
+#define TITLE_ROW ((LCD_ROWS - 2) / 2)
+#define TITLE_COLUMN ((LCD_COLS - 16) / 2)
+int titleScreenPositions[2] = {TITLE_ROW * LCD_COLS + TITLE_COLUMN, (TITLE_ROW + 1) * LCD_COLS + TITLE_COLUMN};
 int titleScreenChars[2][16] = {{0x4E, 0x45, 0x42, 0x55, 0x4C, 0x41, 0x10, 0x43,
                                 0x4F, 0x4E, 0x51, 0x55, 0x45, 0x52, 0x4F, 0x52},
 							   {0x50, 0x72, 0x65, 0x73, 0x73, 0x10, 0x23, 0x10,
                                 0x74, 0x6F, 0x10, 0x53, 0x74, 0x61, 0x72, 0x74}};
 
-// notes for intro song
-int notesForSong[8] = {370, 280, 370, 230, 230, 370, 205 , 230};
-
-
-
+// note numbers for music tracks, C4 to C6 in semitones. 0 is a rest
+#define NOTE_REST 0
+#define NOTE_C4 1
+#define NOTE_E4 5
+#define NOTE_G4 8
+#define NOTE_A4 10
+#define NOTE_B4 12
+#define NOTE_C5 13
+#define NOTE_D5 15
+#define NOTE_E5 17
+#define NOTE_G5 20
+#define NOTE_A5 22
+#define NOTE_C6 25
+
+// each note as a held envelope step at 50% duty, equal tempered from A4 at 440 Hz
+const struct EnvelopeStep noteSteps[26] = {
+    {0, 0, 0},
+    {3822, 1911, 0}, {3608, 1804, 0}, {3405, 1702, 0}, {3214, 1607, 0}, {3034, 1517, 0}, {2863, 1431, 0},   // C4 to F4
+    {2703, 1351, 0}, {2551, 1275, 0}, {2408, 1204, 0}, {2273, 1136, 0}, {2145, 1072, 0}, {2025, 1012, 0},   // FS4 to B4
+    {1911, 955, 0}, {1804, 902, 0}, {1703, 851, 0}, {1607, 803, 0}, {1517, 758, 0}, {1432, 716, 0},   // C5 to F5
+    {1351, 675, 0}, {1276, 638, 0}, {1204, 602, 0}, {1136, 568, 0}, {1073, 536, 0}, {1012, 506, 0},   // FS5 to B5
+    {956, 478, 0},   // C6
+};
+
+// a piece of music. events holds a note number and a length in steps for each note,
+// and stepMs sets the tempo
+struct Track {
+    const unsigned char *events;
+    unsigned char notes;
+    unsigned short stepMs;
+};
+
+// the intro song, eight notes of 270 ms each like the original busy wait version
+const unsigned char introEvents[] = {
+    NOTE_B4, 1, NOTE_E5, 1, NOTE_B4, 1, NOTE_G5, 1,
+    NOTE_G5, 1, NOTE_B4, 1, NOTE_A5, 1, NOTE_G5, 1
+};
+const struct Track introTrack = {introEvents, sizeof(introEvents) / 2, 270};
+
+// sequencer state, it plays on VOICE_MUSIC. The interrupt owns these while a track plays, the main loop only
+// changes them through musicStart, musicQueue and musicStop
+const struct Track *volatile musicTrack = 0;
+const struct Track *volatile musicNext = 0;
+volatile int musicEvent = 0;
+
+
+
+// the host test driver at the bottom of this file has its own main
+#ifndef HOST_TEST
 int main(void) {
 
     // seed the rand function
     srand((unsigned) 100);
 
+    clockInitialize();
+
     InitializeLCD();
 
+    // from here on display writes are queued and sent from the Timer1 interrupt
+    LCDqueueInitialize();
+
+#if LCD_BENCHMARK
+    LCDbenchmark();
+#endif
+
+    soundInitialize();
+
     TimerInterruptInitialize();
 
-    // flag for starting the title screen on first run
-    titleScreenFlag = 1;
+    tickInitialize();
 
-    // once title screen is displayed, this is flagged so the
-    // display will not continually update
-    int titleScreenOn = 0;
+    keypadInitialize();
+
+    // the game starts on the title screen, gameFlow draws it on the first tick
+    titleScreenFlag = 1;
 
     while(1){
 
-        // set the starting conditions
-    	if(startGameNow){
-			startGame();
-			startGameNow = 0;
-		}
+        // step the game through every tick since the last loop
+        runSimulation();
 
-        // display title screen
-    	while (titleScreenFlag) {
-
-    		if(!titleScreenOn){
-    			playerDown = 0;
-    			displayTitleScreen();
-    			titleScreenOn = 1;
-    		}
-
-            // detect hash key to start
-    		keyDetect();
-    	}
-
-        // set flag back to zero
-    	titleScreenOn = 0;
-
-        // run gameloop functions
-        animateStars();
-        scrollBackground();
-        keyDetect();
-        moveWeapons();
-        collisionAnimation();
-        spawnEnemy();
-        moveEnemy();
-        enemyFire();
-
-        // if animateFlag is true, run writeDisplay function
-        if(animateFlag == 1){
-            writeDisplay();
-            animateFlag = 0;
-        }
+        // draw the latest state if the display is ready for it
+        renderFrame();
 
-        // wait one ms per loop
-        wait_ms(baseAnimateSpeed);
+        updateRates();
+
+        // sleep until the next tick. If this loop overran, the tick has already moved on
+        waitForTick(schedulerTick);
     }
     return 0;
 }
+#endif
+
+// lines every inPlay task up to run its phase ticks from the current tick
+void schedulerStart() {
+    for(int i = 0; i < TASK_COUNT; i++){
+        if(tasks[i].inPlay) tasks[i].due = schedulerTick + tasks[i].phase;
+    }
+}
+
+// runs every task that is due on schedulerTick. Due ticks move on a whole period at a
+// time, so how long a run or writeDisplay takes never shifts the game's timing. A task that
+// fell a whole period or more behind runs once and drops the runs it missed
+void runDueTasks() {
+    for(int i = 0; i < TASK_COUNT; i++){
+        struct Task *task = &tasks[i];
+        if(task->inPlay && titleScreenFlag) continue;
+        if((int)(schedulerTick - task->due) < 0) continue;
+
+        task->due += task->period;
+        while((int)(schedulerTick - task->due) >= 0){
+            task->due += task->period;
+            tasksSkipped++;
+        }
+
+        task->run();
+    }
+}
+
+// moves a task's next run to a number of ticks from the current tick. A task can call this
+// on itself to wait longer than its period
+void delayTask(int task, int ticks) {
+    tasks[task].due = schedulerTick + ticks;
+}
+
+// steps the game once for every tick since the last step, so the game runs at the tick
+// rate however long drawing takes. Each step runs the due tasks and then resolves
+// collisions. Ticks that arrive while catching up wait for the next call
+void runSimulation() {
+    unsigned int now = tickCount;
+
+    // too far behind to catch up without holding up the display, drop the oldest ticks
+    unsigned int behind = now - schedulerTick;
+    if(behind > SIM_MAX_CATCHUP){
+        simStepsDropped += behind - SIM_MAX_CATCHUP;
+        schedulerTick += behind - SIM_MAX_CATCHUP;
+    }
+
+    while(schedulerTick != now){
+        schedulerTick++;
+        runDueTasks();
+
+        // everything has moved, find what ran into what
+        resolveCollisions();
+
+        simSteps++;
+    }
+}
 
-// initialize two interrupt timers
+// draws the latest game state once the LCD queue has sent everything from the last frame.
+// Until then changes only build up in the dirty bitmap, so a busy display shows fewer
+// frames without slowing the game down. The title screen is drawn by gameFlow
+void renderFrame() {
+    if(titleScreenFlag) return;
+    if(lcdQueueHead != lcdQueueTail) return;
+
+    // draw whatever changed, this returns straight away when nothing did
+    writeDisplay();
+}
+
+// once a second moves the step and frame counts into simStepsPerSec and framesPerSec,
+// and works out the sound interrupt rate and load. The title screen is drawn by gameFlow
+// and presents no frames, so a second spent on it reads 0 fps
+void updateRates() {
+    if(tickCount - rateWindowStart < 1000000 / TICK_US) return;
+
+    simStepsPerSec = simSteps;
+    framesPerSec = framesPresented;
+
+    // the sound counters only ever go up, so take the difference from last time
+    unsigned int irqs = soundIrqs;
+    unsigned int cycles = soundIrqCycles;
+    soundIrqPerSec = irqs - soundIrqsLast;
+    soundLoadPermille = (cycles - soundIrqCyclesLast) / (CCLK_HZ / 1000);
+    soundIrqsLast = irqs;
+    soundIrqCyclesLast = cycles;
+    simSteps = 0;
+    framesPresented = 0;
+    rateWindowStart += 1000000 / TICK_US;
+
+    // after a long stall start a fresh window rather than reporting several at once
+    if(tickCount - rateWindowStart >= 1000000 / TICK_US) rateWindowStart = tickCount;
+}
+
+// shows the title screen until the hash key is pressed, then starts the intro song and
+// the game together. When the player's explosion finishes, collisionAnimation brings
+// the title screen back and this goes round again
+void gameFlow() {
+    CO_BEGIN(&gameFlowCo);
+    while(1){
+
+        // set the starting conditions, the gameMap is drawn once play starts
+        startGame();
+        playerDown = 0;
+        titleScreenFlag = 1;
+        displayTitleScreen();
+
+        // keyDetect clears titleScreenFlag when the hash key is pressed
+        CO_WAIT_UNTIL(&gameFlowCo, !titleScreenFlag);
+
+        musicStart(&introTrack);
+        schedulerStart();
+
+        CO_WAIT_UNTIL(&gameFlowCo, titleScreenFlag);
+
+        // the player's explosion has finished
+        musicStop();
+        soundPlay(SFX_GAME_OVER);
+    }
+    CO_END(&gameFlowCo);
+}
+
+// starts Timer0 interrupting once every sound frame. MR3 is set by the music sequencer
 void TimerInterruptInitialize() {
-	T0MR0 = T0TC + noteValue / 2;	// 1st interrupt 1000 clocks from now (2.7 ms)
-	T0MR1 = T0TC + noteValue;	    // 1st interrupt 1000 clocks from now (2.7 ms)
+	T0MR0 = T0TC + SOUND_FRAME_US * (PCLK_HZ / 1000000);   // 1st frame one frame from now
 	T0IR = (1<<0);			        // Clear old MR0 match events
-	T0IR = (1<<1);                  // Clear old MR1 match events
     T0MCR |= (1<<0); 		        // Interrupt on MR0 match
-    T0MCR |= (1<<3);                // Interrupt on MR1 match
     T0TCR = 1; 				        // Make sure timer enabled
     ISER0 = (1<<1); 		        // Enable Timer0 interrupts
 }
 
-// interrupt function called when match events are detected
+// interrupt function called when match events are detected. Counts its calls and the
+// cycles it takes for soundIrqPerSec and soundLoadPermille
 void TIMER0_IRQHandler() {
-	// Only need to check timer’s IR if using multiple
-	// interrupt conditions with the same timer
+	unsigned int start = DWT_CYCCNT;
+	soundIrqs++;
+
 	if ((T0IR>>0) & 1) { 			    // check for MR0 event
-		T0MR0 = T0MR0 + noteValue; 		// noteValue added
+		T0MR0 = T0MR0 + SOUND_FRAME_US * (PCLK_HZ / 1000000);
 		T0IR = (1<<0); 				    // clear MR0 event
+		soundFrame();
+	}
 
-        // if soundFlag is detected, set pin 23 high, increment soundFlag
-		if(soundFlag != -1 && soundFlag < 150){
-			FIO0PIN |= (1 << 21);
-			soundFlag++;
-		}
+	if ((T0IR>>3) & 1) {                // check for MR3 event
+		T0IR = (1<<3);                  // clear MR3 event
+		musicNextEvent();
 	}
 
-	if ((T0IR>>1) & 1) { 			    // check for MR1 event
-		T0MR1 = T0MR1 + noteValue; 		// noteValue added
-		T0IR = (1<<1); 				    // clear MR1 event
-
-        // if soundFlag detected, set pin 23 low, increment noteValue by 1 percent
-        // and increment soundFlag. incrementing noteValue lowers the pitch of the
-        // note slightly on the next loop
-		if(soundFlag != -1 && soundFlag < 151){
-			noteValue += (int)(noteValue * 0.01);
-			FIO0PIN &= ~(1 << 21);
-			soundFlag++;
-		}
+	unsigned int cycles = DWT_CYCCNT - start;
+	soundIrqCycles += cycles;
+	if(cycles > soundIrqMaxCycles) soundIrqMaxCycles = cycles;
+}
 
-        // if soundFlag equal to 151, reset soundFlag and noteValue
-		else if( soundFlag >= 151){
-			soundFlag = -1;
-			noteValue = 1000;
-		}
-	}
+// PWM1 counts us and resets at MR0, PWM1.1 goes high at the start of each period and
+// low at MR1. The piezo moved from P0.21 to P2.0, the PWM1.1 pin
+void soundInitialize() {
+#if SOUND_DAC
+    dacInitialize();
+#else
+    PINSEL4 = (PINSEL4 & ~3) | 1;       // P2.0 is PWM1.1
+    PWM1TCR = 2;                        // Hold the counter in reset while configuring
+    PWM1PR = PCLK_HZ / 1000000 - 1;     // One count per us
+    PWM1MCR = (1<<1);                   // Reset on MR0
+    PWM1MR0 = 1000;
+    PWM1MR1 = 0;                        // Silent until a voice plays
+    PWM1LER = (1<<0) | (1<<1);          // Latch MR0 and MR1
+    PWM1PCR = (1<<9);                   // Enable the PWM1.1 output
+    PWM1TCR = (1<<0) | (1<<3);          // Start the counter in PWM mode
+#endif
 }
 
-// writes gameMap data to display. Handles all logic for what gets displayed and what does not
-void writeDisplay(){
+// loads an envelope step's period and high time into PWM1, or silence for 0. The new
+// values are latched at the end of the current period so the waveform never glitches
+void pwmLoad(const struct EnvelopeStep *step) {
+    if(step == soundStep) return;
+    soundStep = step;
+
+    if(step){
+        PWM1MR0 = step->periodUs;
+        PWM1MR1 = step->highUs;
+    }
+    else {
+        PWM1MR1 = 0;
+    }
+    PWM1LER = (1<<0) | (1<<1);
+}
+
+// starts a voice on a run of envelope steps, or silences it for 0 steps
+void setVoice(int voice, const struct EnvelopeStep *steps, int count) {
+    voices[voice].step = count ? steps : 0;
+    voices[voice].stepsLeft = count - 1;
+    voices[voice].framesLeft = count ? steps->frames : 0;
+}
 
-    // step through each location in the gameMap
-    for(int i = 0; i < 80; i++){
+// plays one of the SFX_ sound effects, replacing whatever its voice was playing. In the
+// SOUND_DAC build an effect with a sample plays that instead of its envelope
+void soundPlay(int effect) {
+    const struct SoundEffect *sfx = &soundEffects[effect];
+
+    ICER0 = (1<<1);                     // Disable Timer0 interrupts
+#if SOUND_DAC
+    ICER0 = (1<<26);                    // Disable GPDMA interrupts
+    volatile struct SampleChannel *channel = &sampleChannels[sfx->voice];
+    channel->sample = effectSamples[effect];
+    channel->position = 0;
+    channel->index = 0;
+    channel->predictor = 0;
+    if(channel->sample) setVoice(sfx->voice, 0, 0);
+    else setVoice(sfx->voice, sfx->steps, sfx->count);
+    ISER0 = (1<<26);                    // Enable GPDMA interrupts
+#else
+    setVoice(sfx->voice, sfx->steps, sfx->count);
+#endif
+    ISER0 = (1<<1);                     // Enable Timer0 interrupts
+}
 
-        // if the gameMap location equals the gameMapLast location, continue the loop immediately.
-        // This saves unecessary writes and speeds up the display
-        if(gameMapLast[i] == gameMap[i]){
+// counts down every voice's step and moves on to its next one when it runs out, then
+// gives the piezo to the next voice with a note sounding. With one voice playing it
+// keeps the piezo, with several they take turns a slice each so they are all heard together.
+// There is no arithmetic on the sound itself, only counters and loads from the tables.
+// The DAC mixes every voice at once, so there it only steps the envelopes
+void soundFrame() {
+    for(int v = 0; v < VOICES; v++){
+        volatile struct Voice *voice = &voices[v];
+        if(!voice->step || !voice->framesLeft) continue;
+        if(--voice->framesLeft) continue;
+
+        if(voice->stepsLeft == 0){
+            voice->step = 0;
             continue;
         }
+        voice->stepsLeft--;
+        voice->step++;
+        voice->framesLeft = voice->step->frames;
+    }
 
-            // if not, update the gameMapLast array with the new information
-        else{
-            gameMapLast[i] = gameMap[i];
-        }
+#if !SOUND_DAC
+    // the voice with the piezo keeps it to the end of its slice while it has a note,
+    // following its own envelope
+    const struct EnvelopeStep *current = voices[soundVoice].step;
+    if(soundSliceLeft && current && current->periodUs){
+        soundSliceLeft--;
+        pwmLoad(current);
+        return;
+    }
 
-        // create necessary variables
-        int tempShip;
-        int tempWeapon;
+    int v = soundVoice;
+    for(int n = 0; n < VOICES; n++){
+        if(++v == VOICES) v = 0;
+        const struct EnvelopeStep *step = voices[v].step;
+        if(step && step->periodUs){
+            soundVoice = v;
+            soundSliceLeft = SOUND_SLICE_FRAMES - 1;
+            pwmLoad(step);
+            return;
+        }
+    }
+    pwmLoad(0);
+#endif
+}
 
-        // mask the data off with ship and weapon mask, if greater than zero display either a weapon, ship or
-        // collision animation
-        if((gameMap[i] & (shipMask + weaponMask)) > 0){
+#if SOUND_DAC
+// GPDMA channel 0 moves one word per DAC request from the current block to DACR. Each
+// link ends with a terminal count interrupt and hands over to the other block, and the
+// DAC double buffers so the output only changes when its timer runs out
+void dacInitialize() {
+    PINSEL1 = (PINSEL1 & ~(3<<20)) | (2<<20);      // P0.26 is AOUT
+    PINMODE1 = (PINMODE1 & ~(3<<20)) | (2<<20);    // No pull resistor on AOUT
+    PCONP |= (1<<29);                              // Power up the GPDMA
+
+    for (int b = 0; b < 2; b++) {
+        for (int i = 0; i < DAC_BLOCK; i++) {
+            dacBuffer[b][i] = DAC_MIDSCALE << 6;
+        }
+        dacLinks[b].source = (DmaAddress) dacBuffer[b];
+        dacLinks[b].destination = DACR_ADDRESS;
+        dacLinks[b].next = (DmaAddress) &dacLinks[b ^ 1];
+        // block length, 32 bit source and destination, source increments, interrupt at the end
+        dacLinks[b].control = DAC_BLOCK | (2<<18) | (2<<21) | (1<<26) | (1u<<31);
+    }
+    dacHalf = 0;
+
+    DMACConfig = 1;                     // Enable the GPDMA
+    DMACIntTCClear = (1<<0);            // Clear old channel 0 events
+    DMACIntErrClr = (1<<0);
+    DMACC0SrcAddr = dacLinks[0].source;
+    DMACC0DestAddr = dacLinks[0].destination;
+    DMACC0LLI = dacLinks[0].next;
+    DMACC0Control = dacLinks[0].control;
+    DMACC0Config = (7<<6) | (1<<11) | (1<<15) | 1;  // To the DAC, memory to peripheral, interrupt, enable
+
+    DACCNTVAL = PCLK_HZ / DAC_RATE_HZ;  // One request per sample
+    DACCTRL = (1<<1) | (1<<2) | (1<<3); // Double buffer, run the counter, request DMA
+    ISER0 = (1<<26);                    // Enable GPDMA interrupts
+}
 
-            // call the LCDwriteCommand function to prepare sending the ASCII data
+// channel 0 has finished a block and moved on to the other one, so the finished block is
+// mixed again while the other plays. Counted in with the Timer0 figures
+void DMA_IRQHandler() {
+	unsigned int start = DWT_CYCCNT;
+	soundIrqs++;
+
+	if ((DMACIntTCStat>>0) & 1) {       // check for channel 0 terminal count
+		DMACIntTCClear = (1<<0);        // clear channel 0 event
+		soundMixBlock(dacBuffer[dacHalf]);
+		dacHalf ^= 1;
+		dacBlocks++;
+	}
 
-            // if both ship data and weapon data present at location, call the writeCollision function
-            // this has the effect of writing gameMap with a collisionAtPosition marker. writeDisplay is called
-            // again immediately and the collision animation happens within the writeShip function
-            if((gameMap[i] & shipMask) > 0 && (gameMap[i] & weaponMask) > 0){
-                tempShip = gameMap[i] & shipMask;
-                tempWeapon = gameMap[i] & weaponMask;
+	unsigned int cycles = DWT_CYCCNT - start;
+	soundIrqCycles += cycles;
+	if(cycles > dacMixMaxCycles) dacMixMaxCycles = cycles;
+}
 
-                if(tempShip == collisionAtPosition){
-                    LCDwriteCommand(AddressCodes[i]);
-                    writeShip(tempShip, i);
-                }
+// mixes every voice into a block, its sample when it has one and otherwise a square wave
+// from its current envelope step, then turns the sums into DACR words. The envelopes
+// move on between blocks, so a step that starts part way through a block is heard
+// from the next one
+void soundMixBlock(unsigned int *block) {
+    int mix[DAC_BLOCK] = {0};
 
-                // if the shipFB marker is detected the ship type data is saved in the gameMap location
-                // in the previous array location, so this is extracted and sent to writeCollision function
-                else if(tempShip == shipFB) {
-                    tempShip = gameMap[i - 1] & shipMask;
-                    writeCollision(tempShip, tempWeapon, i);
-                }
-                else{
-                    writeCollision(tempShip, tempWeapon, i);
-                }
+    for (int v = 0; v < VOICES; v++) {
+        if (sampleChannels[v].sample) {
+            mixSample(&sampleChannels[v], mix);
+            continue;
+        }
 
-            }
+        const struct EnvelopeStep *step = voices[v].step;
+        if (!step || !step->periodUs) continue;
+
+        unsigned int period = step->periodUs;
+        unsigned int high = step->highUs;
+        unsigned int phase = dacPhase[v];
+        if (phase >= period) phase = 0;
+        for (int i = 0; i < DAC_BLOCK; i++) {
+            mix[i] += phase < high ? DAC_VOICE_LEVEL : -DAC_VOICE_LEVEL;
+            phase += DAC_SAMPLE_US;
+            if (phase >= period) phase -= period;
+        }
+        dacPhase[v] = phase;
+    }
 
-            // if just ship data, write ship characters
-            else if((gameMap[i] & shipMask) > 0){
-                tempShip = gameMap[i] & shipMask;
-                LCDwriteCommand(AddressCodes[i]);
-                writeShip(tempShip, i);
-            }
+    for (int i = 0; i < DAC_BLOCK; i++) {
+        int value = DAC_MIDSCALE + mix[i];
+        if (value < 0) value = 0;
+        if (value > 1023) value = 1023;
+        block[i] = value << 6;
+    }
+}
 
-            // if just weapon, write a weapon character
-            else{
-                tempWeapon = gameMap[i] & weaponMask;
-                LCDwriteCommand(AddressCodes[i]);
-                writeWeapon(tempWeapon);
-            }
+// adds up to a block of a voice's sample to mix, decoding ADPCM as it goes, and frees
+// the voice once the sample is over
+void mixSample(volatile struct SampleChannel *channel, int *mix) {
+    const struct Sample *sample = channel->sample;
+    int position = channel->position;
+    int count = sample->length - position;
+    if (count > DAC_BLOCK) count = DAC_BLOCK;
+
+    if (sample->format == SAMPLE_PCM8) {
+        const unsigned char *data = sample->data + position;
+        for (int i = 0; i < count; i++) {
+            mix[i] += data[i] - 128;
         }
-
-        // if only star data at location, write a star
-        else if((gameMap[i] & starMask) > 0){
-            int star = gameMap[i] & starMask;
-            LCDwriteCommand(AddressCodes[i]);
-            writeStar(star);
+    }
+    else {
+        int predictor = channel->predictor;
+        int index = channel->index;
+        for (int i = 0; i < count; i++) {
+            int at = position + i;
+            int code = (sample->data[at >> 1] >> ((at & 1) * 4)) & 0x0F;
+            int step = adpcmSteps[index];
+            int diff = step >> 3;
+            if (code & 4) diff += step;
+            if (code & 2) diff += step >> 1;
+            if (code & 1) diff += step >> 2;
+            predictor += code & 8 ? -diff : diff;
+            if (predictor > 32767) predictor = 32767;
+            if (predictor < -32768) predictor = -32768;
+            index += adpcmIndexChange[code & 7];
+            if (index < 0) index = 0;
+            if (index > 88) index = 88;
+            mix[i] += predictor >> 8;
         }
+        channel->predictor = predictor;
+        channel->index = index;
+    }
 
-        // if nothing, write a blank
-        else if(gameMap[i] == noStar){
-            LCDwriteCommand(AddressCodes[i]);
-            LCDwriteData(blank);
-        }
+    position += count;
+    channel->position = position;
+    if (position >= sample->length) channel->sample = 0;
+}
+#endif
+
+// plays the next note of the track, or the first note of the queued track once the
+// track is over. The next MR3 match is set from the last one, so note lengths do not
+// depend on how late the interrupt ran. With nothing left, MR3 stops interrupting
+void musicNextEvent() {
+    if(musicTrack && musicEvent >= musicTrack->notes){
+        musicTrack = musicNext;
+        musicNext = 0;
+        musicEvent = 0;
+    }
+
+    if(!musicTrack){
+        T0MCR &= ~(1<<9);
+        setVoice(VOICE_MUSIC, 0, 0);
+        return;
     }
+
+    const unsigned char *event = &musicTrack->events[musicEvent * 2];
+    musicEvent++;
+
+    setVoice(VOICE_MUSIC, &noteSteps[event[0]], 1);
+    T0MR3 = T0MR3 + event[1] * musicTrack->stepMs * (PCLK_HZ / 1000);
 }
 
-// moves weapons once created
-void moveWeapons(){
+// plays a track from its first note, replacing anything playing or queued. Timer0
+// interrupts are held off while the sequencer changes, a match in the meantime stays
+// pending until they are let back in
+void musicStart(const struct Track *track) {
+    ICER0 = (1<<1);                     // Disable Timer0 interrupts
+    musicTrack = track;
+    musicNext = 0;
+    musicEvent = 0;
+    T0IR = (1<<3);                      // Clear old MR3 match events
+    T0MR3 = T0TC;
+    T0MCR |= (1<<9);                    // Interrupt on MR3 match
+    musicNextEvent();
+    ISER0 = (1<<1);                     // Enable Timer0 interrupts
+}
+
+// plays a track once the one playing finishes, or straight away when nothing is
+void musicQueue(const struct Track *track) {
+    ICER0 = (1<<1);
+    if(musicTrack){
+        musicNext = track;
+        ISER0 = (1<<1);
+        return;
+    }
+    musicStart(track);
+}
 
+// silences the music and forgets any queued track
+void musicStop() {
+    ICER0 = (1<<1);
+    musicTrack = 0;
+    musicNext = 0;
+    T0MCR &= ~(1<<9);
+    setVoice(VOICE_MUSIC, 0, 0);
+    ISER0 = (1<<1);
+}
 
-    // ms until next move
-    int loopsTillMove = 35;
+// true while a track is playing
+int musicPlaying() {
+    return musicTrack != 0;
+}
 
+// writes gameMap data to display. Handles all logic for what gets displayed and what does not.
+// Only locations marked in dirtyCells are visited, in DDRAM order, and they are sent in runs
+// that are contiguous in DDRAM so the address auto-increment set up in InitializeLCD does the
+// work of the set address commands.
+// Locations are drawn in priority order (player and collisions, then weapons and enemies,
+// then the background) until renderBudgetUs of bus time is used up. Whatever is left stays
+// dirty and is drawn on the next frame
+void writeDisplay(){
 
-    // checks if loop condition satisfied
-    if (loopWeaponBlast >= loopsTillMove){
+    // nothing changed since the last frame
+    unsigned int anyDirty = 0;
+    for(int w = 0; w < DIRTY_WORDS; w++){
+        anyDirty |= dirtyCells[w] & ~heldCells[w];
+    }
+    if(anyDirty == 0) return;
 
-        // checks the weapon location array for weapons and increments/decrements accordingly
-        for(int i = 0; i < 20; i++){
+    framesPresented++;
+    renderDeferredCells = 0;
+    unsigned int frameStart = micros();
 
-            // checks if there is weapon location data at this location in the array
-            if(weaponPositions[i] != -1){
+    // transfers still waiting in the LCD queue count against this frame's budget
+    int busUs = 0;
+    if(lcdQueueRunning){
+        busUs = (lcdQueueHead - lcdQueueTail) * LCD_EXEC_US;
+    }
+    int queuedUs = busUs;
+
+    // lastWritten is the position in displayOrder of the last cell sent, the LCD address
+    // counter sits just after it. -1 when the address counter is somewhere else
+    int lastWritten = -1;
+    for(int priority = 0; priority < RENDER_PRIORITIES; priority++){
+        for(int w = 0; w < DIRTY_WORDS; w++){
+            unsigned int bits = dirtyCells[w] & ~heldCells[w];
+            while(bits){
+                int k = w * 32 + __builtin_ctz(bits);
+                int i = displayOrder[k];
+                bits &= bits - 1;
+
+                // a location takes the higher priority of what is there now and what is on screen,
+                // so a weapon leaving a location is erased as promptly as one arriving is drawn
+                int sprite = cellGlyph(i);
+                int cellPriority = spritePriority[sprite];
+                if(spritePriority[displaySprites[i]] < cellPriority){
+                    cellPriority = spritePriority[displaySprites[i]];
+                }
+                if(cellPriority != priority) continue;
+
+                // keep the current run going if the cells in between are next to each other in DDRAM
+                // and rewriting them costs no more than a new set address command
+                int gap = k - lastWritten - 1;
+                int continueRun = lastWritten >= 0 && gap >= 0 && gap <= LCD_RUN_GAP_MAX &&
+                                  AddressCodes[i] - AddressCodes[displayOrder[lastWritten]] == k - lastWritten;
+
+                // transfers this location needs, a CGRAM upload breaks the run
+                int transfers = continueRun ? gap + 1 : 2;
+                if(spriteNeedsUpload(sprite)){
+                    transfers = 9 + 2;
+                    continueRun = 0;
+                }
 
-                // if the weapon has not reached the edge of the screen, increment its location
-                if(weaponPositions[i] != 19 && weaponPositions[i] != 39 &&
-                   weaponPositions[i] != 59 && weaponPositions[i] != 79){
-                    weaponPositions[i]++;
+                // out of time, leave this and everything after it for the next frame. Held
+                // locations are waiting for their flash, not for bus time, so they do not count
+                if(busUs + transfers * LCD_EXEC_US > renderBudgetUs){
+                    for(int d = 0; d < DIRTY_WORDS; d++){
+                        renderDeferredCells += __builtin_popcount(dirtyCells[d] & ~heldCells[d]);
+                    }
+                    goto deferred;
                 }
+                busUs += transfers * LCD_EXEC_US;
 
-                // if the weapon has reached the edge of the screen, set the weaponsPosition array back to no
-                // weapon in the array location and decrement the weaponsOnScreen variable
-                else if(weaponPositions[i] == 19 || weaponPositions[i] == 39 ||
-                        weaponPositions[i] == 59 || weaponPositions[i] == 79){
+                // swap the location over to its new character, loading CGRAM if needed
+                setDisplayChar(i, blank);
+                setDisplayChar(i, spriteChar(sprite));
+                displaySprites[i] = sprite;
 
-                    gameMap[weaponPositions[i]] = gameMap[weaponPositions[i]] & (shipMask + starMask);
-                    weaponPositions[i] = -1;
+                if(continueRun){
+                    for(int g = lastWritten + 1; g < k; g++){
+                        LCDwriteData(displayChars[displayOrder[g]]);
+                    }
+                }
+                else {
+                    LCDwriteCommand(AddressCodes[i]);
                 }
+
+                LCDwriteData(displayChars[i]);
+                lastWritten = k;
+                dirtyCells[w] &= ~(1u << (k & 31));
             }
+        }
+    }
+
+deferred:
+    renderDeferredTotal += renderDeferredCells;
 
+    if(busUs - queuedUs > renderWorstBusUs) renderWorstBusUs = busUs - queuedUs;
+
+    int frameUs = micros() - frameStart;
+    if(frameUs > renderWorstFrameUs) renderWorstFrameUs = frameUs;
+}
+
+// true when drawing a sprite would mean loading it into CGRAM first
+int spriteNeedsUpload(int sprite){
+    if(sprite >= SPRITE_FIRST_ROM_ONLY) return 0;
+    for(int slot = 0; slot < 8; slot++){
+        if(cgramSprite[slot] == sprite) return 0;
+    }
+    return 1;
+}
+
+// looks a sprite up in the CGRAM slots. On a miss the least recently used slot that is not
+// on screen is loaded with the sprite's bitmap; when every slot is on screen the sprite
+// falls back to its ROM character
+int spriteChar(int sprite){
+    if(sprite >= SPRITE_FIRST_ROM_ONLY) return spriteRomChars[sprite];
+
+    cgramClock++;
+    int victim = -1;
+    for(int slot = 0; slot < 8; slot++){
+        if(cgramSprite[slot] == sprite){
+            cgramHits++;
+            cgramLastUse[slot] = cgramClock;
+            return slot;
         }
+        if(cgramRefs[slot] == 0 && (victim == -1 || cgramLastUse[slot] < cgramLastUse[victim])){
+            victim = slot;
+        }
+    }
 
-        for(int i = 0; i < 10; i++){
+    cgramMisses++;
+    if(victim == -1) return spriteRomChars[sprite];
 
-            // checks if there is weapon location data at this location in the array
-            if(enemyWeaponPos[i] != -1){
+    // upload the bitmap, this leaves the address counter in CGRAM so writeDisplay
+    // always starts with a set address command
+    LCDwriteCommand(0x40 | (victim << 3));
+    for(int row = 0; row < 8; row++){
+        LCDwriteData(spriteBitmaps[sprite][row]);
+    }
+    cgramByteWrites += 8;
 
-                // if the weapon has not reached the edge of the screen, decrement its location
-                if(enemyWeaponPos[i] != 0 && enemyWeaponPos[i] != 20 &&
-                   enemyWeaponPos[i] != 40 && enemyWeaponPos[i] != 60){
+    cgramSprite[victim] = sprite;
+    cgramLastUse[victim] = cgramClock;
+    return victim;
+}
 
-                    enemyWeaponPos[i]--;
-                }
+// character codes 0-7 are the CGRAM slots, count the locations showing each one
+void setDisplayChar(int location, int character){
+    int old = displayChars[location];
+    if(old < 8) cgramRefs[old]--;
+    if(character < 8) cgramRefs[character]++;
+    displayChars[location] = character;
+}
 
-                    // if the weapon has reached the edge of the screen, set the weaponsPosition array back to no
-                    // weapon in the array location and decrement the weaponsOnScreen variable
-                else if(enemyWeaponPos[i] == 0  || enemyWeaponPos[i] == 20 ||
-                        enemyWeaponPos[i] == 40 || enemyWeaponPos[i] == 60){
+// the display was cleared or overwritten, nothing on it uses CGRAM any more. The slots
+// keep their bitmaps so sprites can be reused without another upload
+void resetDisplayChars(){
+    for(int i = 0; i < LCD_CELLS; i++){
+        displayChars[i] = blank;
+        displaySprites[i] = SPRITE_BLANK;
+    }
+    for(int slot = 0; slot < 8; slot++){
+        cgramRefs[slot] = 0;
+    }
+}
 
-                    gameMap[enemyWeaponPos[i]] = gameMap[enemyWeaponPos[i]] & (shipMask + starMask);
-                    enemyWeaponPos[i] = -1;
-                }
-            }
+// changes a gameMap location and marks it for redrawing if the value is different
+void setGameMap(int location, int value){
+    if(gameMap[location] == value) return;
+    gameMap[location] = value;
+    markCellDirty(location);
+}
 
-        }
+// sets the dirty bit for a location, the bit position is the location's place in DDRAM order
+void markCellDirty(int location){
+    int k = cellOrder[location];
+    dirtyCells[k >> 5] |= 1u << (k & 31);
+}
 
+// marks every location for redrawing, used when the whole screen was overwritten
+void markAllCellsDirty(){
+    for(int k = 0; k < LCD_CELLS; k++){
+        dirtyCells[k >> 5] |= 1u << (k & 31);
+    }
+}
 
+// returns the sprite that represents a gameMap location on the display
+int cellGlyph(int location){
+    int tempShip = cellShip(location);
 
-        // remove previous position player weapons blasts
-        for(int i = 0; i < 20; i++){
-            if(weaponPositions[i] != -1){
-                gameMap[weaponPositions[i] - 1] = gameMap[weaponPositions[i] - 1] & (shipMask + starMask);
+    // ships are drawn over anything else in the cell. The front of a ship is found
+    // from the ship type stored in the previous location
+    if(tempShip == shipFB){
+        return shipFrontGlyph(cellShip(location - 1));
+    }
+    if(tempShip > 0){
+        return shipGlyph(tempShip, location);
+    }
+    if(cellWeapon(location) > 0){
+        return weaponGlyph(cellWeapon(location));
+    }
+    return starGlyph(cellStar(location));
+}
 
-            }
-        }
+// moves weapons once created, runs every 35 ms
+void moveWeapons(){
 
-        // remove previous position enemy weapons blasts
-        for(int i = 0; i < 10; i++){
-            if(enemyWeaponPos[i] != -1){
-				gameMap[enemyWeaponPos[i] + 1] = gameMap[enemyWeaponPos[i] + 1] & (shipMask + starMask);
-            }
-        }
 
-        // check for player and enemy weapon collisions. Delete from corresponding arrays and
-        // write collision animation to screen
-        for(int i = 0; i < 20; i++){
-        	for(int j = 0; j < 10; j++){
-				if(weaponPositions[i] != -1 && enemyWeaponPos[j] != -1 && weaponPositions[i] == enemyWeaponPos[j]){
-					LCDwriteCommand(AddressCodes[weaponPositions[i]]);
-					LCDwriteData(0xFF);
-					wait_ms(50);
-					LCDwriteCommand(AddressCodes[weaponPositions[i]]);
-					LCDwriteData(blank);
-					weaponPositions[i] = -1;
-					enemyWeaponPos[j] = -1;
-				}
+    // moves every weapon in the pool one location and removes the ones at the edge of the screen
+    for(int n = weaponPool.count - 1; n >= 0; n--){
+        int i = weaponPool.active[n];
 
-				if(weaponPositions[i] != -1 && enemyWeaponPos[j] != -1 && weaponPositions[i] + 1 == enemyWeaponPos[j]){
-					LCDwriteCommand(AddressCodes[weaponPositions[i]]);
-					LCDwriteData(0xFF);
-					LCDwriteCommand(AddressCodes[weaponPositions[i] + 1]);
-					LCDwriteData(0xFF);
-					wait_ms(50);
-					LCDwriteCommand(AddressCodes[weaponPositions[i]]);
-					LCDwriteData(blank);
-					LCDwriteCommand(AddressCodes[weaponPositions[i] + 1]);
-					LCDwriteData(blank);
-					weaponPositions[i] = -1;
-					enemyWeaponPos[j] = -1;
-				}
-        	}
+        // if the weapon has not reached the edge of the screen, increment its location
+        if(LOCATION_COLUMN(weaponPositions[i]) != LAST_COLUMN){
+            weaponPositions[i]++;
+        }
 
+        // if the weapon has reached the edge of the screen, remove it and give its slot back
+        else{
+            setCellWeapon(weaponPositions[i], 0);
+            poolFree(&weaponPool, i);
         }
+    }
 
-        // write moved weapons blast to appropriate gameMap position
-        for(int i = 0; i < 20; i++){
-            if(weaponPositions[i] != -1){
-                gameMap[weaponPositions[i]] = gameMap[weaponPositions[i]] & (shipMask + starMask);
-                gameMap[weaponPositions[i]] += doubleBlast;
+    for(int n = enemyWeaponPool.count - 1; n >= 0; n--){
+        int i = enemyWeaponPool.active[n];
 
-            }
+        // if the weapon has not reached the edge of the screen, decrement its location
+        if(LOCATION_COLUMN(enemyWeaponPos[i]) != 0){
+            enemyWeaponPos[i]--;
         }
 
-        for(int i = 0; i < 10; i++){
-            if(enemyWeaponPos[i] != -1){
-                gameMap[enemyWeaponPos[i]] = gameMap[enemyWeaponPos[i]] & (shipMask + starMask);
-        		gameMap[enemyWeaponPos[i]] += enemyBlast;
-            }
+        // if the weapon has reached the edge of the screen, remove it and give its slot back
+        else{
+            setCellWeapon(enemyWeaponPos[i], 0);
+            poolFree(&enemyWeaponPool, i);
         }
-
-        // update the animateFlag variable and set the loop back to zero
-        animateFlag = 1;
-        loopWeaponBlast = 0;
     }
 
+    // remove previous position player weapons blasts
+    for(int n = 0; n < weaponPool.count; n++){
+        setCellWeapon(weaponPositions[weaponPool.active[n]] - 1, 0);
+    }
 
-    // increment loopWeaponBlast
-    loopWeaponBlast++;
+    // remove previous position enemy weapons blasts
+    for(int n = 0; n < enemyWeaponPool.count; n++){
+        setCellWeapon(enemyWeaponPos[enemyWeaponPool.active[n]] + 1, 0);
+    }
 
+    // write moved weapons blast to appropriate gameMap position
+    for(int n = 0; n < weaponPool.count; n++){
+        setCellWeapon(weaponPositions[weaponPool.active[n]], doubleBlast);
+    }
 
+    for(int n = 0; n < enemyWeaponPool.count; n++){
+    		setCellWeapon(enemyWeaponPos[enemyWeaponPool.active[n]], enemyBlast);
+    }
 }
 
-// write a weapon to the display
-void writeWeapon(int toWeapon) {
+// returns the sprite for a weapon
+int weaponGlyph(int toWeapon) {
     switch(toWeapon){
         case doubleBlast:
-            LCDwriteData(weapons[0]);
-            break;
+            return SPRITE_DOUBLE_BLAST;
         case specialBlast:
-        	LCDwriteData(weapons[1]);
-        	break;
+        	return SPRITE_SPECIAL_BLAST;
         case enemyBlast:
-        	LCDwriteData(weapons[2]);
-        	break;
+        	return SPRITE_ENEMY_BLAST;
         default:
-            break;
+            return SPRITE_BLANK;
     }
 
 }
 
-// write a ship to the display
-void writeShip(int toShip, int toLocation){
+// returns the sprite for the rear of a ship, or the collision animation frame at this location
+int shipGlyph(int toShip, int toLocation){
     switch(toShip){
-
-        // this case ignores the shipFront case as the front is written in sequence with the rear
-        // of the ship when that character is called.
-        case shipFB:
-            break;
         case playerShip:
-            LCDwriteData(ships[0]);
-            LCDwriteData(ships[1]);
-            break;
+            return SPRITE_PLAYER;
         case enemy1:
-            LCDwriteData(ships[2]);
-            LCDwriteData(ships[3]);
-            break;
+            return SPRITE_ENEMY1;
         case enemy2:
-            LCDwriteData(ships[4]);
-            LCDwriteData(ships[5]);
-            break;
+            return SPRITE_ENEMY2;
         case enemy3:
-            LCDwriteData(ships[6]);
-            LCDwriteData(ships[7]);
-            break;
+            return SPRITE_ENEMY3;
         case enemy4:
-            LCDwriteData(ships[8]);
-            LCDwriteData(ships[9]);
-            break;
+            return SPRITE_ENEMY4;
 
         // this case checks the collisionAnimAtPos array to decide when frame in the collision animation
         // should be played when called
         case collisionAtPosition:
-            for(int i = 0; i < 10; i++){
+            for(int n = 0; n < collisionPool.count; n++){
+                int i = collisionPool.active[n];
                 if(collisionAnimAtPos[0][i] == toLocation){
-                    switch (collisionAnimAtPos[1][i]) {
-                        case 0:
-                            LCDwriteData(collisionArr[0]);
-                            break;
-
-                        case 1:
-                            LCDwriteData(collisionArr[1]);
-                            break;
-
-                        case 2:
-                            LCDwriteData(collisionArr[2]);
-                            break;
-                    }
+                    return SPRITE_COLLISION + collisionAnimAtPos[1][i];
                 }
             }
-            break;
+            return SPRITE_BLANK;
         default:
-            break;
+            return SPRITE_BLANK;
     }
 }
 
-// write a collision to the display
-void writeCollision(int toShip, int toWeapon, int toLocation){
-
-    // if player ship and collides with enemy blast
-    if(toShip == playerShip && toWeapon == enemyBlast){
+// returns the sprite for the front of a ship, which sits in the shipFB location
+int shipFrontGlyph(int toShip){
+    switch(toShip){
+        case playerShip:
+            return SPRITE_PLAYER + 1;
+        case enemy1:
+            return SPRITE_ENEMY1 + 1;
+        case enemy2:
+            return SPRITE_ENEMY2 + 1;
+        case enemy3:
+            return SPRITE_ENEMY3 + 1;
+        case enemy4:
+            return SPRITE_ENEMY4 + 1;
+        default:
+            return SPRITE_BLANK;
+    }
+}
 
-        // this flag effectively ends the game, but allows the collision animation to play
-    	playerDown = 1;
-
-        // write the first collision array character to display
-        LCDwriteData(collisionArr[0]);
-
-        // remove ship and weapons data
-        gameMap[toLocation] = gameMap[toLocation] & starMask;
-        gameMap[toLocation - 1] = gameMap[toLocation - 1] & starMask;
-        playerPosition[0] = 20;
-        playerPosition[1] = 21;
+// sets the occupancy masks from where every entity is now. Ships cover two cells
+void buildOccupancy(){
+    for(int r = 0; r < LCD_ROWS; r++){
+        playerShotRows[r] = 0;
+        enemyShotRows[r] = 0;
+        enemyRows[r] = 0;
+        playerRows[r] = 0;
+    }
+    for(int n = 0; n < weaponPool.count; n++){
+        OCCUPY(playerShotRows, weaponPositions[weaponPool.active[n]], 1);
+    }
+    for(int n = 0; n < enemyWeaponPool.count; n++){
+        OCCUPY(enemyShotRows, enemyWeaponPos[enemyWeaponPool.active[n]], 1);
+    }
+    for(int n = 0; n < enemyPool.count; n++){
+        OCCUPY(enemyRows, enemyPosFire[0][enemyPool.active[n]], 2);
+    }
+    if(!playerDown){
+        OCCUPY(playerRows, playerPosition[0], 2);
+    }
+}
 
-        // remove an enemy blast from its array
-        for(int i = 0; i < 10; i++){
-            if(enemyWeaponPos[i] == toLocation){
-                enemyWeaponPos[i] = -1;
-            }
+// checks every line for collisions. Weapons that meet destroy each other, as do weapons
+// about to pass through each other (player blast directly left of an enemy blast). A player
+// blast over an enemy destroys the enemy, and an enemy blast or enemy over the player ends
+// the game
+void resolveCollisions(){
+    buildOccupancy();
+
+    for(int r = 0; r < LCD_ROWS; r++){
+        RowBits playerShots = playerShotRows[r];
+        RowBits enemyShots = enemyShotRows[r];
+
+        // player blasts with an enemy blast in the same or the next cell
+        RowBits hits = playerShots & (enemyShots | enemyShots >> 1);
+        while(hits){
+            int column = ROW_CTZ(hits);
+            hits &= hits - 1;
+            int location = r * LCD_COLS + column;
+
+            // the flash covers both cells when the blasts are side by side
+            int width = (enemyShots >> column & 1) ? 1 : 2;
+            int enemyLocation = location + width - 1;
+
+            startFlash(location, enemyLocation);
+
+            removeShotsAt(&weaponPool, weaponPositions, location);
+            removeShotsAt(&enemyWeaponPool, enemyWeaponPos, enemyLocation);
+            playerShots &= ~ROW_BIT(column);
+            enemyShots &= ~ROW_BIT(column + width - 1);
         }
 
-
-        // add collision markers
-        gameMap[toLocation] += collisionAtPosition;
-        gameMap[toLocation - 1] += collisionAtPosition;
-
-        // create collision animation at first available array location with location marker
-        // and start collision animation at zero
-        for(int i = 0; i < 10; i++){
-            if(collisionAnimAtPos[0][i] == -1){
-                collisionAnimAtPos[0][i] = toLocation - 1;
-                collisionAnimAtPos[1][i] = 0;
-                break;
+        // player blasts that hit an enemy
+        hits = playerShots & enemyRows[r];
+        if(hits){
+            for(int n = enemyPool.count - 1; n >= 0; n--){
+                int i = enemyPool.active[n];
+                int location = enemyPosFire[0][i];
+                if(LOCATION_ROW(location) == r && (hits >> LOCATION_COLUMN(location) & 3)){
+                    removeShotsAt(&weaponPool, weaponPositions, location);
+                    removeShotsAt(&weaponPool, weaponPositions, location + 1);
+                    destroyEnemy(i);
+                }
             }
         }
 
-        // create collision animation at first available array location with location marker
-        // and start collision animation at zero (twice for two character display locations)
-        for(int i = 0; i < 10; i++){
-            if(collisionAnimAtPos[0][i] == -1){
-                collisionAnimAtPos[0][i] = toLocation;
-                collisionAnimAtPos[1][i] = 0;
-                break;
+        // enemy blasts or enemies on the player
+        if(playerRows[r] & (enemyShots | enemyRows[r])){
+            removeShotsAt(&enemyWeaponPool, enemyWeaponPos, playerPosition[0]);
+            removeShotsAt(&enemyWeaponPool, enemyWeaponPos, playerPosition[1]);
+            for(int n = enemyPool.count - 1; n >= 0; n--){
+                int i = enemyPool.active[n];
+                int location = enemyPosFire[0][i];
+                if(LOCATION_ROW(location) == r && (playerRows[r] >> LOCATION_COLUMN(location) & 3)){
+                    destroyEnemy(i);
+                }
             }
+            destroyPlayer();
         }
     }
+}
 
-    // if player laser blast hits an enemy ship
-    else if(toShip !=playerShip && toWeapon == doubleBlast){
-
-        // remove ship and weapons data
-        gameMap[toLocation] = gameMap[toLocation] & starMask;
-        gameMap[toLocation + 1] = gameMap[toLocation + 1] & starMask;
-        for(int i = 0; i < 4; i++){
-        	if(enemyPosFire[0][i] == toLocation){
-        		enemyPosFire[0][i] = -1;
-        		enemyPosFire[1][i] = -1;
-        	}
-        }
+// shows an explosion flash over one or two locations. They are held so writeDisplay leaves
+// the flash up while the game carries on underneath. With every flash slot in use the
+// locations are just redrawn
+void startFlash(int location, int otherLocation) {
+    int i = poolAlloc(&flashPool);
+    if(i < 0){
+        markCellDirty(location);
+        markCellDirty(otherLocation);
+        return;
+    }
+    flashAt[0][i] = location;
+    flashAt[1][i] = otherLocation;
+    flashCo[i].line = 0;
+    flashStep(i);
+}
 
-        // remove player blast from its array
-        for(int i = 0; i < 20; i++){
-            if(weaponPositions[i] == toLocation){
-                weaponPositions[i] = -1;
-            }
-        }
+// steps every explosion flash on screen
+void runFlashes() {
+    for(int n = flashPool.count - 1; n >= 0; n--){
+        flashStep(flashPool.active[n]);
+    }
+}
 
-        // add collision markers
-        gameMap[toLocation] += collisionAtPosition;
-        gameMap[toLocation + 1] += collisionAtPosition;
-
-        // create collision animation at first available array location with location marker
-        // and start collision animation at zero
-        for(int i = 0; i < 10; i++){
-            if(collisionAnimAtPos[0][i] == -1){
-                collisionAnimAtPos[0][i] = toLocation;
-                collisionAnimAtPos[1][i] = 0;
-                break;
-            }
-        }
+// draws the flash, holds it for FLASH_TICKS, then lets writeDisplay redraw what is there now
+void flashStep(int i) {
+    struct Coroutine *co = &flashCo[i];
+    CO_BEGIN(co);
+
+    for(int f = 0; f < 2; f++){
+        int k = cellOrder[flashAt[f][i]];
+        heldCells[k >> 5] |= 1u << (k & 31);
+        LCDwriteCommand(AddressCodes[flashAt[f][i]]);
+        LCDwriteData(0xFF);
+        setDisplayChar(flashAt[f][i], 0xFF);
+    }
 
-        // create collision animation at first available array location with location marker
-        // and start collision animation at zero (twice for two character display locations)
-        for(int i = 0; i < 10; i++){
-            if(collisionAnimAtPos[0][i] == -1){
-                collisionAnimAtPos[0][i] = toLocation + 1;
-                collisionAnimAtPos[1][i] = 0;
-                break;
-            }
-        }
+    CO_DELAY(co, FLASH_TICKS);
 
+    for(int f = 0; f < 2; f++){
+        int k = cellOrder[flashAt[f][i]];
+        heldCells[k >> 5] &= ~(1u << (k & 31));
+        markCellDirty(flashAt[f][i]);
     }
+    poolFree(&flashPool, i);
 
-    // increment collisionsOnScreen
-    collisionsOnScreen+= 2;
-//    collisionsOnScreen++;
-    animateFlag = 1;
+    CO_END(co);
 }
 
-// increment the collisionAnimAtPos array for displaying collision animation
-void collisionAnimation(){
+// this flag effectively ends the game, but allows the collision animation to play
+void destroyPlayer(){
+    playerDown = 1;
 
-    // return if no collisions on screen
-    if(collisionsOnScreen == 0) return;
+    // remove ship and weapons data
+    setGameMap(playerPosition[0], cellStar(playerPosition[0]));
+    setGameMap(playerPosition[1], cellStar(playerPosition[1]));
 
-    // time between increments
-    int loopsTillCollisionAnimation = 200;
+    // add collision markers and animations over both character display locations
+    startCollision(playerPosition[0]);
+    startCollision(playerPosition[1]);
 
-    if(loopCollision >= loopsTillCollisionAnimation){
+    playerPosition[0] = PLAYER_START;
+    playerPosition[1] = PLAYER_START + 1;
 
-        // check array for collision animations to increment
-        for (int i = 0; i < 10; i++){
+    soundPlay(SFX_EXPLOSION);
+}
 
-            // continue if none at array location
-            if(collisionAnimAtPos[0][i] == -1) continue;
+// remove ship and weapons data, then replace the ship with collision animations
+void destroyEnemy(int i){
+    int location = enemyPosFire[0][i];
 
-            // increment collision animation if less than 2
-            if(collisionAnimAtPos[1][i] < 2 && collisionAnimAtPos[1][i] != -1){
-                collisionAnimAtPos[1][i]++;
+    setGameMap(location, cellStar(location));
+    setGameMap(location + 1, cellStar(location + 1));
+    poolFree(&enemyPool, i);
 
-                // increment the gameMap by doubleBlast. This acts as a flag to writeDisplay that the
-                // gameMap has changed, otherwise the function will not know that a change needs to
-                // written to the display
-                gameMap[collisionAnimAtPos[0][i]] += doubleBlast;
+    startCollision(location);
+    startCollision(location + 1);
 
-                // call the writeDisplay function
-                animateFlag = 1;
-            }
-            else{
-                // remove collision marker
-                gameMap[collisionAnimAtPos[0][i]] = gameMap[collisionAnimAtPos[0][i]] & starMask;
+    soundPlay(SFX_EXPLOSION);
+}
 
-                // reset collisionAnimAtPos array to initialized at location
-                collisionAnimAtPos[0][i] = -1;
-                collisionAnimAtPos[1][i] = -1;
+// frees the weapons at a location from their pool
+void removeShotsAt(struct EntityPool *pool, int *positions, int location){
+    for(int n = pool->count - 1; n >= 0; n--){
+        int i = pool->active[n];
+        if(positions[i] == location){
+            setCellWeapon(location, 0);
+            poolFree(pool, i);
+        }
+    }
+}
 
-                // decrement collisionsOnScreen;
-                collisionsOnScreen--;
+// create collision animation in a free slot with location marker and start it at zero.
+// With no slot left the location is just cleared, a marker without an animation would
+// never be removed
+void startCollision(int location){
 
-                // when the player is down, this resets the game after the collision animation plays
-                if(playerDown){
-                	titleScreenFlag = 1;
-                	startGameNow = 1;
-                }
-            }
+    // a location already animating starts over rather than taking a second slot
+    int i = -1;
+    for(int n = 0; n < collisionPool.count; n++){
+        if(collisionAnimAtPos[0][collisionPool.active[n]] == location){
+            i = collisionPool.active[n];
         }
-        loopCollision = 0;
     }
-    else{
-        loopCollision++;
+    if(i < 0) i = poolAlloc(&collisionPool);
+    if(i < 0) return;
+
+    setCellShip(location, collisionAtPosition);
+    markCellDirty(location);
+    collisionAnimAtPos[0][i] = location;
+    collisionAnimAtPos[1][i] = 0;
+}
+
+// increment the collisionAnimAtPos array for displaying collision animation, runs every 200 ms
+void collisionAnimation(){
+
+    // check the pool for collision animations to increment
+    for (int n = collisionPool.count - 1; n >= 0; n--){
+        int i = collisionPool.active[n];
+
+        // increment collision animation if less than 2
+        if(collisionAnimAtPos[1][i] < 2){
+            collisionAnimAtPos[1][i]++;
+
+            // the gameMap itself does not change between frames, so tell writeDisplay
+            // the location needs to be redrawn
+            markCellDirty(collisionAnimAtPos[0][i]);
+        }
+        else{
+            // remove collision marker
+            setGameMap(collisionAnimAtPos[0][i], cellStar(collisionAnimAtPos[0][i]));
+
+            // give the animation's slot back
+            poolFree(&collisionPool, i);
+
+            // when the player is down, this resets the game after the collision animation plays
+            if(playerDown){
+            	titleScreenFlag = 1;
+            }
+        }
     }
 }
 
-// write a star to the display
-void writeStar(int toWrite){
+// returns the sprite for a star
+int starGlyph(int toWrite){
     switch (toWrite){
         case star1A:
-            LCDwriteData(star1[0]);
-            break;
+            return SPRITE_STAR1A;
         case star1B:
-            LCDwriteData(star1[1]);
-            break;
+            return SPRITE_STAR1B;
         case star2A:
-            LCDwriteData(star2[0]);
-            break;
+            return SPRITE_STAR2A;
         case star2B:
-            LCDwriteData(star2[1]);
-            break;
+            return SPRITE_STAR2B;
         case star3A:
-            LCDwriteData(star3[0]);
-            break;
+            return SPRITE_STAR3A;
         case star3B:
-            LCDwriteData(star3[1]);
-            break;
+            return SPRITE_STAR3B;
         default:
-            LCDwriteData(blank);
+            return SPRITE_BLANK;
     }
 
 }
-// This function spawns enemies every 1.5 seconds
-void spawnEnemy(){
-
-    // check to see whether there are enough enemies on screen
-	int enemyArrCheck = 0;
-	for(int i = 0; i < 4; i++){
-		if(enemyPosFire[0][i] >= 0){
-		enemyArrCheck++;
-		}
-	}
-
-    // if there are four enemies on screen, return from this function
-	if(enemyArrCheck == 4) return;
-
-    // spawn time every 1.5 seconds
-    int loopSpawnTime = 1500;
 
-    if(loopSpawnEnemy <= loopSpawnTime){
-        loopSpawnEnemy++;
-        return;
-    }
-
-    // random number 0 - 15
-    int lineSpawn = rand() % 16;
-
-    // set enemy position based on lineSpawn within the enemyPosFire array
-    if(lineSpawn < 4){
-
-        // check if there is a ship or weapons already at this location and return if so
-        if((gameMap[18] & shipMask) > 0 || (gameMap[19] & shipMask) > 0 ||
-		(gameMap[18] & weaponMask) == doubleBlast || (gameMap[19] & weaponMask) == doubleBlast) {
-        	return;
-		}
-
-        // set the enemy position in the enemyPosFire array as the end of the first line
-    	for(int i = 0; i < 4; i++){
-    		if (enemyPosFire[0][i] == -1){
-    			enemyPosFire[0][i] = 18;
-    			break;
-    		}
-    	}
+// an enemy cannot appear over a ship, a collision or a player blast. Enemy blasts are
+// ignored the same as they are for enemies already on screen. The occupancy masks are
+// only built for resolveCollisions at the end of a tick, while the gameMap is kept up to
+// date by every move, so one spawn attempt is two cell reads and no mask rebuild
+int spawnCellFree(int location){
+    for(int c = location; c < location + 2; c++){
+        if(cellShip(c) || cellWeapon(c) == doubleBlast) return 0;
     }
+    return 1;
+}
 
-    if(lineSpawn >= 4 && lineSpawn < 8){
-        if((gameMap[38] & shipMask) > 0 || (gameMap[39] & shipMask) > 0 ||
-		(gameMap[38] & weaponMask) == doubleBlast || (gameMap[39] & weaponMask) == doubleBlast) {
-        	return;
-		}
+// This function spawns an enemy from spawnTable every time the last spawn's cooldown runs out.
+// It runs every tick until it can spawn, then delays its task by the entry's cooldown
+void spawnEnemy(){
 
-        // set the enemy position in the enemyPosFire array as the end of the second line
-    	for(int i = 0; i < 4; i++){
-    		if (enemyPosFire[0][i] == -1){
-    			enemyPosFire[0][i] = 38;
-    			break;
-    		}
-    	}
-    }
+    // if the enemy pool is full, return from this function
+	if(enemyPool.count == enemyPool.capacity) return;
 
-    if(lineSpawn >= 8 && lineSpawn < 12){
-        if((gameMap[58] & shipMask) > 0 || (gameMap[59] & shipMask) > 0 ||
-		(gameMap[58] & weaponMask) == doubleBlast || (gameMap[59] & weaponMask) == doubleBlast) {
-        	return;
-		}
+    // pick an entry, the weights decide how often each comes up
+    const struct SpawnEntry *spawn = &spawnTable[spawnPicks[rand() % SPAWN_WEIGHT_TOTAL]];
 
-        // set the enemy position in the enemyPosFire array as the end of the third line
-    	for(int i = 0; i < 4; i++){
-    		if (enemyPosFire[0][i] == -1){
-    			enemyPosFire[0][i] = 58;
-    			break;
-    		}
-    	}
-    }
+    // if the spawn location is taken, try again next tick
+    if(!spawnCellFree(spawn->location)) return;
 
-    if(lineSpawn >= 12){
-        if((gameMap[78] & shipMask) > 0 || (gameMap[79] & shipMask) > 0 ||
-		(gameMap[78] & weaponMask) == doubleBlast || (gameMap[79] & weaponMask) == doubleBlast) {
-        	return;
-		}
+    // set the enemy position in a new enemyPool slot and write it to the gameMap
+    int i = poolAlloc(&enemyPool);
+    enemyPosFire[0][i] = spawn->location;
+    enemyPosFire[1][i] = -1;
+    setCellShip(spawn->location, spawn->ship);
+    setCellShip(spawn->location + 1, shipFB);
 
-        // set the enemy position in the enemyPosFire array as the end of the fourth line
-    	for(int i = 0; i < 4; i++){
-    		if (enemyPosFire[0][i] == -1){
-    			enemyPosFire[0][i] = 78;
-    			break;
-    		}
-    	}
-	}
+    delayTask(TASK_SPAWN_ENEMY, spawn->cooldown);
+}
 
-    // write enemies to gameMap based on lineSpawn value. This determines both location (1 of 4 lines)
-    // and enemy type (1 of 4 enemies) hence 16 cases
-    switch (lineSpawn) {
-        case 0:
-        	gameMap[18] += enemy1;
-        	gameMap[19] += shipFB;
-            break;
-		case 1:
-			gameMap[18] += enemy2;
-			gameMap[19] += shipFB;
-			break;
-		case 2:
-			gameMap[18] += enemy3;
-			gameMap[19] += shipFB;
-			break;
-		case 3:
-			gameMap[18] += enemy4;
-			gameMap[19] += shipFB;
-			break;
-		case 4:
-			gameMap[38] += enemy1;
-			gameMap[39] += shipFB;
-            break;
-        case 5:
-        	gameMap[38] += enemy2;
-			gameMap[39] += shipFB;
-			break;
-		case 6:
-			gameMap[38] += enemy3;
-			gameMap[39] += shipFB;
-			break;
-		case 7:
-			gameMap[38] += enemy4;
-			gameMap[39] += shipFB;
-            break;
-		case 8:
-			gameMap[58] += enemy1;
-			gameMap[59] += shipFB;
-			break;
-		case 9:
-			gameMap[58] += enemy2;
-			gameMap[59] += shipFB;
-			break;
-		case 10:
-			gameMap[58] += enemy3;
-			gameMap[59] += shipFB;
-			break;
-		case 11:
-			gameMap[58] += enemy4;
-			gameMap[59] += shipFB;
-			break;
-		case 12:
-			gameMap[78] += enemy1;
-			gameMap[79] += shipFB;
-			break;
-		case 13:
-			gameMap[78] += enemy2;
-			gameMap[79] += shipFB;
-			break;
-		case 14:
-			gameMap[78] += enemy3;
-			gameMap[79] += shipFB;
-			break;
-		case 15:
-			gameMap[78] += enemy4;
-			gameMap[79] += shipFB;
-			break;
-		default:
-			break;
-    }
-
-    loopSpawnEnemy = 0;
-    animateFlag = 1;
-
-}
-
-// This function moves enemies on screen at appropriate intervals
+// This function moves enemies on screen, runs every quarter second
 void moveEnemy(){
 
-    // move enemies forward every quarter second
-    int moveEnemyTime = 250;
-
-    if(loopMoveEnemy < moveEnemyTime){
-        loopMoveEnemy++;
-        return;
-    }
-
-    for(int i = 0; i < 4; i++){
+    for(int n = enemyPool.count - 1; n >= 0; n--){
+        int i = enemyPool.active[n];
 
         // check the gameMap for the locations found in the enemyPosFire array for enemies to move
-        if((gameMap[enemyPosFire[0][i]] & shipMask) == enemy1 || (gameMap[enemyPosFire[0][i]] & shipMask) == enemy2 ||
-        (gameMap[enemyPosFire[0][i]] & shipMask) == enemy3 || (gameMap[enemyPosFire[0][i]] & shipMask) == enemy4){
-
-            // if the enemy is at the edge of the screen, remove from gameMap and enemyPosFire array
-            if(enemyPosFire[0][i] == 0 || enemyPosFire[0][i] == 20 || enemyPosFire[0][i] == 40 || enemyPosFire[0][i] == 60){
-            	gameMap[enemyPosFire[0][i]] = gameMap[enemyPosFire[0][i]] & (starMask + weaponMask);
-            	gameMap[enemyPosFire[0][i] + 1] = gameMap[enemyPosFire[0][i] + 1] & (starMask + weaponMask);
-            	enemyPosFire[0][i] = -1;
+        if(cellShip(enemyPosFire[0][i]) == enemy1 || cellShip(enemyPosFire[0][i]) == enemy2 ||
+        cellShip(enemyPosFire[0][i]) == enemy3 || cellShip(enemyPosFire[0][i]) == enemy4){
+
+            // if the enemy is at the edge of the screen, remove from gameMap and enemyPool
+            if(LOCATION_COLUMN(enemyPosFire[0][i]) == 0){
+            	setCellShip(enemyPosFire[0][i], 0);
+            	setCellShip(enemyPosFire[0][i] + 1, 0);
+            	poolFree(&enemyPool, i);
             }
 
             // move the enemy forward
             else {
 
                 // grab ship info and place in temp variable
-                int tempShip = gameMap[enemyPosFire[0][i]] & shipMask;
-
-                // clear info from cell both ship cells
-                gameMap[enemyPosFire[0][i]] = gameMap[enemyPosFire[0][i]] & (starMask + weaponMask);
-                gameMap[enemyPosFire[0][i] + 1] = gameMap[enemyPosFire[0][i] + 1] & (starMask + weaponMask);
+                int tempShip = cellShip(enemyPosFire[0][i]);
 
-                // add shipFront flag current cell
-                gameMap[enemyPosFire[0][i]] += shipFB;
+                // clear the back of the ship and turn the old front into the back
+                setCellShip(enemyPosFire[0][i] + 1, 0);
+                setCellShip(enemyPosFire[0][i], shipFB);
 
-                // clear leading cell and add ship info
-                gameMap[enemyPosFire[0][i] - 1] = gameMap[enemyPosFire[0][i] - 1] & (starMask + weaponMask);
-                gameMap[enemyPosFire[0][i] - 1] += tempShip;
+                // add ship info to the leading cell
+                setCellShip(enemyPosFire[0][i] - 1, tempShip);
 
                 // decrement the position info to align with its location on screen
                 enemyPosFire[0][i]--;
             }
         }
-    }
-
-    // reset the loop and call the writeDisplay function
-    loopMoveEnemy = 0;
-    animateFlag = 1;
 
+        // the ship is no longer on the gameMap, give its slot back
+        else {
+            poolFree(&enemyPool, i);
+        }
+    }
 }
 
-// this function controls when an enemy fires its weapon
+// this function controls when an enemy fires its weapon, runs every 150 ms
 void enemyFire() {
 
-    // loop time
-	int loopsTillFire = 150;
+    // check every enemy on screen for enemy fire timer info
+	for (int n = 0; n < enemyPool.count; n++) {
+		int i = enemyPool.active[n];
 
-	if (loopEnemyFire < loopsTillFire){
-		loopEnemyFire++;
-		return;
-	}
-
-    // check the four array locations for enemy fire timer info
-	for (int i = 0; i < 4; i++) {
+        // ships at the edge of the screen have nowhere to fire and are about to leave
+		if(LOCATION_COLUMN(enemyPosFire[0][i]) == 0) continue;
 
         // if it equals three, add an enemy blast in front of the appropriate enemy and add
-        // a position to the enemyWeaponPos array
+        // it to the enemy weapon pool
 		if(enemyPosFire[1][i] == 3){
-			for(int j = 0; j < 10; j++){
-				if(enemyWeaponPos[j] == -1){
-					gameMap[enemyPosFire[0][i] - 1] += enemyBlast;
-					enemyWeaponPos[j] = enemyPosFire[0][i] - 1;
-					break;
-				}
+			int j = poolAlloc(&enemyWeaponPool);
+			if(j >= 0){
+				setCellWeapon(enemyPosFire[0][i] - 1, enemyBlast);
+				enemyWeaponPos[j] = enemyPosFire[0][i] - 1;
+				soundPlay(SFX_ENEMY_SHOT);
 			}
-
-            // call the writeDisplay function
-			animateFlag = 1;
 		}
 
         // increment the enemy fire timer info for all ships on screen. This loops every four iterations
-		if(enemyPosFire[0][i] != -1 && enemyPosFire[0][i] != 0 &&
-		enemyPosFire[0][i] != 20 && enemyPosFire[0][i] != 40 && enemyPosFire[0][i] != 60){
-			enemyPosFire[1][i] = (enemyPosFire[1][i] + 1) % 4;
-		}
+		enemyPosFire[1][i] = (enemyPosFire[1][i] + 1) % 4;
 	}
-
-	loopEnemyFire = 0;
 }
 
 // populates the gameMap with the initial on screen elements
@@ -1055,270 +2636,285 @@ void populateBackground() {
 
 
     // blank the gameMap
-    for(int i = 0; i < 80; i++){
-        gameMap[i] = noStar;
+    for(int i = 0; i < LCD_CELLS; i++){
+        setGameMap(i, noStar);
     }
 
     // set the stars at their initial positions
+    for (int r = 0; r < LCD_ROWS; r++) {
+        starPresent[r] = 0;
+        starTypeLow[r] = 0;
+        starTypeHigh[r] = 0;
+        starPhase[r] = 0;
+    }
     for (int i = 0; i < 14; i++) {
-        gameMap[starPositions[i]] += starTypes[i];
+        int row = starPositions[i] / 20;
+        if (row >= LCD_ROWS) continue;
+        for (int column = starPositions[i] % 20; column < LCD_COLS; column += 20) {
+            placeStar(row * LCD_COLS + column, starTypes[i]);
+        }
+    }
+    for (int r = 0; r < LCD_ROWS; r++) {
+        syncStars(r, starPresent[r]);
     }
 
     // set the player positions on the gameMap
-    gameMap[playerPosition[0]] += playerShip;
-    gameMap[playerPosition[1]] += shipFB;
+    setCellShip(playerPosition[0], playerShip);
+    setCellShip(playerPosition[1], shipFB);
 
 }
 
-// twinkles the stars in the background on a set loop
-void animateStars() {
+// adds a star to the star field, the value is one of the star constants
+void placeStar(int location, int star){
+    int r = LOCATION_ROW(location);
+    RowBits bit = ROW_BIT(LOCATION_COLUMN(location));
 
-    // ms per loop between switch over in star animation
-    int loopsTillAnimate = 175;
-    if (loopCountAniStars == loopsTillAnimate) {
-
-        // check all gameMap array locations for stars
-        for (int i = 0; i < 80; i++) {
-
-            // set gameMap star data to tempStar variable
-            int tempStar = (gameMap[i] & starMask);
-            if (tempStar == noStar) continue;
-
-            // switch case changes star data based on tempStar data, twinkles star
-            switch (tempStar) {
-                case star1A:
-                    gameMap[i] -= star1A;
-                    gameMap[i] += star1B;
-                    break;
-                case star1B:
-                    gameMap[i] -= star1B;
-                    gameMap[i] += star1A;
-                    break;
-                case star2A:
-                    gameMap[i] -= star2A;
-                    gameMap[i] += star2B;
-                    break;
-                case star2B:
-                    gameMap[i] -= star2B;
-                    gameMap[i] += star2A;
-                    break;
-                case star3A:
-                    gameMap[i] -= star3A;
-                    gameMap[i] += star3B;
-                    break;
-                case star3B:
-                    gameMap[i] -= star3B;
-                    gameMap[i] += star3A;
-                    break;
-                default:
-                    break;
-            }
+    starPresent[r] |= bit;
+    if(star & 0x02) starTypeLow[r] |= bit;
+    if(star & 0x04) starTypeHigh[r] |= bit;
+    if(star & 0x01) starPhase[r] |= bit;
+}
+
+// writes the star in each changed column into the gameMap. A location under a ship or
+// weapon looks the same whatever star is behind it, so it takes the new star without
+// being marked for redrawing
+void syncStars(int row, RowBits changed){
+    while(changed){
+        int column = ROW_CTZ(changed);
+        changed &= changed - 1;
+
+        int location = row * LCD_COLS + column;
+        int star = (starTypeHigh[row] >> column & 1) << 2 |
+                   (starTypeLow[row] >> column & 1) << 1 |
+                   (starPhase[row] >> column & 1);
+
+        if(gameMap[location] & (shipMask | weaponMask)){
+            gameMap[location] = (gameMap[location] & ~starMask) | star;
         }
+        else {
+            setCellStar(location, star);
+        }
+    }
+}
 
-        // set animate flag to 1 to call writeDisplay function
-        animateFlag = 1;
+// twinkles the stars in the background, runs every 175 ms
+void animateStars() {
 
-        // set loop count back to zero
-        loopCountAniStars = 0;
-    }
-    else {
-        loopCountAniStars++;
+    // every star swaps to its other frame, A and B only differ in the phase bit
+    for (int r = 0; r < LCD_ROWS; r++) {
+        starPhase[r] ^= starPresent[r];
+        syncStars(r, starPresent[r]);
     }
 }
 
-// shift the star data one location to the left
+// shift the star data one location to the left, stars at the left edge of the screen
+// come back in at the right edge. Runs every 525 ms
 void scrollBackground(){
+    for(int r = 0; r < LCD_ROWS; r++){
+        RowBits present = ROW_ROTATE(starPresent[r]);
+        RowBits low = ROW_ROTATE(starTypeLow[r]);
+        RowBits high = ROW_ROTATE(starTypeHigh[r]);
+        RowBits phase = ROW_ROTATE(starPhase[r]);
+
+        // only columns whose star is different afterwards need to go to the gameMap
+        RowBits changed = (present ^ starPresent[r]) | (low ^ starTypeLow[r]) |
+                               (high ^ starTypeHigh[r]) | (phase ^ starPhase[r]);
+
+        starPresent[r] = present;
+        starTypeLow[r] = low;
+        starTypeHigh[r] = high;
+        starPhase[r] = phase;
+        syncStars(r, changed);
+    }
+}
 
-    // ms before next shift
-    int loopsTillShift = 1050 / 2;
-    int tempEdgeStar = 0x00;
+// acts on the keypad, runs every tick. Presses arrive in keyEvents from keypadScan, so
+// one is acted on the tick after it is debounced, and a direction held down moves again
+// every KEY_REPEAT_TICKS. With no key down and no events it returns straight away.
+// Firing and moving do not wait on each other, and a move can go across and up or
+// down at once
+void keyDetect(){
 
-    if (loopCountShiftStars == loopsTillShift){
-        for(int i = 0; i < 80; i++){
+    while (keyEventTail != keyEventHead) {
+        struct KeyEvent *event = &keyEvents[keyEventTail & (KEY_QUEUE_SIZE - 1)];
+        if (event->pressed) {
+            keysHeld |= 1 << event->key;
+            keysPressed |= 1 << event->key;
+            keyPressTime = event->time;
+        }
+        else {
+            keysHeld &= ~(1 << event->key);
+        }
+        keyEventTail++;
+    }
 
-            // mask gameMap data for star data only
-            int tempPotStar = gameMap[i] & starMask;
+    if (!(keysHeld | keysPressed)) return;
 
-            // if the star reaches the edge of the screen (left), assign it to the edge star
-            if(i == 0 || i == 20 || i == 40 || i == 60){
-                tempEdgeStar = tempPotStar;
-                gameMap[i] -= tempPotStar;
-            }
+    // when the game is on the title screen, this function will only look for a fresh
+    // press of the start button, aka the hash button
+    if (titleScreenFlag) {
+        if (keysPressed & (1 << KEY_HASH)) titleScreenFlag = 0;
+        keysPressed = 0;
+        return;
+    }
 
-            // retrieve the edge star and assign it the screen edge (right)
-            else if (i == 19 || i == 39 || i == 59 || i == 79){
-                gameMap[i] -= tempPotStar;
-                gameMap[i] += tempEdgeStar;
-                tempEdgeStar = 0x00;
-                gameMap[i - 1] += tempPotStar;
-            }
+    // lock out key presses when player is killed
+    if (playerDown) {
+        keysPressed = 0;
+        return;
+    }
 
-            // move star one location to the left on gameMap
-            else{
-                gameMap[i] -= tempPotStar;
-                gameMap[i - 1] += tempPotStar;
+    int keys = keysHeld | keysPressed;
+    int acted = 0;
+
+    // if hash key pressed, add player blast to gameMap. A press that comes too soon
+    // after the last shot is dropped
+    if ((keys >> KEY_HASH & 1) && schedulerTick - keyLastFire >= KEY_FIRE_TICKS) {
+        if (LOCATION_COLUMN(playerPosition[1]) != LAST_COLUMN) {
+            int i = poolAlloc(&weaponPool);
+            if (i >= 0) {
+                setCellWeapon(playerPosition[1] + 1, doubleBlast);
+                weaponPositions[i] = playerPosition[1] + 1;
             }
-
         }
-
-        // set loopCount variable to zero and set animateFlag
-        loopCountShiftStars = 0;
-        animateFlag = 1;
-    }
-    else {
-        // loopCount increment
-        loopCountShiftStars++;
+        keyLastFire = schedulerTick;
+        soundPlay(SFX_LASER);
+        acted |= 1 << KEY_HASH;
     }
-}
+    int fresh = keysPressed;
+    keysPressed &= ~(1 << KEY_HASH);
+
+    // a move pressed during the lock out waits for it to end
+    if ((int)(schedulerTick - keyLockUntil) >= 0) {
+        keysPressed = 0;
+
+        // if 9 key detected, move player forward
+        if (keys >> KEY_9 & 1) {
+            if (LOCATION_COLUMN(playerPosition[1]) != LAST_COLUMN) {
+                setCellShip(playerPosition[1], 0);
+                setCellShip(playerPosition[1] + 1, shipFB);
+                playerPosition[1]++;
+                setCellShip(playerPosition[0], 0);
+                setCellShip(playerPosition[0] + 1, playerShip);
+                playerPosition[0]++;
+                acted |= 1 << KEY_9;
+            }
+        }
 
-void playIntroSong() {
+        // if 8 key detected, move player backwards
+        else if (keys >> KEY_8 & 1) {
+            if (LOCATION_COLUMN(playerPosition[0]) != 0) {
+                setCellShip(playerPosition[0], 0);
+                setCellShip(playerPosition[0] - 1, playerShip);
+                playerPosition[0]--;
+                setCellShip(playerPosition[1], 0);
+                setCellShip(playerPosition[1] - 1, shipFB);
+                playerPosition[1]--;
+                acted |= 1 << KEY_8;
+            }
+        }
 
-    // play all eight notes in array
-	for (int i = 0; i < 8; i++) {
-		int freq = notesForSong[i];
+        // if 0 key detected, move player down
+        if (keys >> KEY_0 & 1) {
+            if (LOCATION_ROW(playerPosition[1]) < LCD_ROWS - 1) {
+                setCellShip(playerPosition[1], 0);
+                setCellShip(playerPosition[1] + LCD_COLS, shipFB);
+                playerPosition[1] += LCD_COLS;
+                setCellShip(playerPosition[0], 0);
+                setCellShip(playerPosition[0] + LCD_COLS, playerShip);
+                playerPosition[0] += LCD_COLS;
+                acted |= 1 << KEY_0;
+            }
+        }
 
-        // play notes for indicated duration
-		for (int j = 0; j < (int)(50000 / freq); j++) {
-			FIO0PIN |= (1 << 21);
+        // if 5 key detected, move player up
+        else if (keys >> KEY_5 & 1) {
+            if (LOCATION_ROW(playerPosition[0]) > 0) {
+                setCellShip(playerPosition[1], 0);
+                setCellShip(playerPosition[1] - LCD_COLS, shipFB);
+                playerPosition[1] -= LCD_COLS;
+                setCellShip(playerPosition[0], 0);
+                setCellShip(playerPosition[0] - LCD_COLS, playerShip);
+                playerPosition[0] -= LCD_COLS;
+                acted |= 1 << KEY_5;
+            }
+        }
 
-			wait_ticks(freq);
+        // the 6 key does nothing
 
-			FIO0PIN &= ~(1 << 21);
+        if (acted & ~(1 << KEY_HASH)) keyLockUntil = schedulerTick + KEY_REPEAT_TICKS;
+    }
 
-			wait_ticks(freq);
-		}
-	}
+    if (acted & fresh) keyLatencyUs = micros() - keyPressTime;
 }
 
-// detects whether a key has been pressed
-void keyDetect(){
-
-    int debounceTimeMin = 50;
-    int loopSpamMin = 100;
+// drives the first keypad output and starts MR3 scanning the keypad every KEY_SCAN_US
+void keypadInitialize() {
+    FIO0SET = 1 << KeyBitsOut[0];
+    FIO0CLR = 1 << KeyBitsOut[1];
+#ifdef HOST_SIM
+    simKeypadDrive(0);
+#endif
+    keyScanColumn = 0;
+    keysDown = 0;
+    keyCount0 = ~0;
+    keyCount1 = ~0;
+
+    T1MR3 = T1TC + KEY_SCAN_US;         // 1st scan one scan from now
+    T1IR = (1<<3);                      // Clear old MR3 match events
+    T1MCR |= (1<<9);                    // Interrupt on MR3 match
+}
 
-    if (loopDebounceCount < debounceTimeMin) {
-    	loopDebounceCount++;
-    	return;
+// reads the keys on the keypad output driven since the last scan, then drives the other
+// one. The inputs get a whole KEY_SCAN_US to follow the outputs, and each scan reads
+// the port once. Every second scan has the whole keypad and debounces all six keys at
+// once with vertical counters: a key's count runs down on each scan it reads
+// differently from keysDown and starts over when it reads the same, and the key flips
+// when the count wraps on the fourth scan. Each flip queues an event
+void keypadScan() {
+    unsigned int pins = FIO0PIN;
+    int rows = (pins >> KeyBitsIn[0] & 1) | (pins >> KeyBitsIn[1] & 1) << 1 | (pins >> KeyBitsIn[2] & 1) << 2;
+
+    int column = keyScanColumn;
+    keyScanColumn = column ^ 1;
+    FIO0CLR = 1 << KeyBitsOut[column];
+    FIO0SET = 1 << KeyBitsOut[column ^ 1];
+#ifdef HOST_SIM
+    simKeypadDrive(column ^ 1);
+#endif
+
+    if (column == 0) {
+        keySample = rows;
+        return;
     }
 
-    // when the game is on the title screen, this function will only try to detect
-    // the start button, aka the hash button
-    if (titleScreenFlag) {
-    	FIO0PIN |= (1 <<KeyBitsOut[0]);
-		FIO0PIN &= ~(1 << KeyBitsOut[1]);
-
-        // when start button is detected, play intro song and then proceed
-		if((FIO0PIN >> KeyBitsIn[0] & 1) == 1){
+    int changed = (keySample | rows << 3) ^ keysDown;
+    keyCount0 = ~(keyCount0 & changed);
+    keyCount1 = keyCount0 ^ (keyCount1 & changed);
+    changed &= keyCount0 & keyCount1;
+    if (!changed) return;
 
-			playIntroSong();
+    int keys = keysDown ^ changed;
+    keysDown = keys;
 
-			titleScreenFlag = 0;
-		}
-		return;
+    unsigned int now = micros();
+    for (int key = 0; key < KEYS; key++) {
+        if (changed >> key & 1) keyEventPush(key, keys >> key & 1, now);
     }
+}
 
-    // lock out key presses when player is killed
-    if(playerDown) return;
-
-
-    // set output pins high/low
-	FIO0PIN |= (1 <<KeyBitsOut[0]);
-	FIO0PIN &= ~(1 << KeyBitsOut[1]);
-
-    // check input pins
-    // if hash key pressed, add player blast to gameMap
-	if((FIO0PIN >> KeyBitsIn[0] & 1) == 1){
-
-		if(loopSpam >= loopSpamMin){
-			loopDebounceCount = 0;
-			gameMap[playerPosition[1] + 1] += doubleBlast;
-			for(int i = 0; i < 20; i++){
-				if(weaponPositions[i] == -1){
-					if(playerPosition[1] != 19 && playerPosition[1] != 39 && playerPosition[1] != 59 && playerPosition[1] != 79) {
-						weaponPositions[i] = playerPosition[1] + 1;
-
-					}
-					break;
-				}
-			}
-			loopSpam = 0;
-			animateFlag = 1;
-			soundFlag = 0;
-			return;
-		}
-	}
-
-    // if 9 key detected, move player forward
-	if((FIO0PIN >> KeyBitsIn[1] & 1) == 1){
-		if(playerPosition[1] != 19 && playerPosition[1] != 39 && playerPosition[1] != 59 && playerPosition[1] != 79){
-			loopDebounceCount = 0;
-			gameMap[playerPosition[1]] -= shipFB;
-			gameMap[playerPosition[1] + 1] += shipFB;
-			playerPosition[1]++;
-			gameMap[playerPosition[0]] -= playerShip;
-			gameMap[playerPosition[0] + 1] += playerShip;
-			playerPosition[0]++;
-			animateFlag = 1;
-		}
-		return;
-	}
-
-    // do nothing when the 6 key is pressed
-	if((FIO0PIN >> KeyBitsIn[2] & 1) == 1){
-		return;
-	}
-
-    // invert the output pins, low/high
-	FIO0PIN |= (1 <<KeyBitsOut[1]);
-	FIO0PIN &= ~(1 << KeyBitsOut[0]);
-
-    // if 0 key detected, move player down
-	if((FIO0PIN >> KeyBitsIn[0] & 1) == 1){
-		if(playerPosition[1] < 60){
-			loopDebounceCount = 0;
-			gameMap[playerPosition[1]] -= shipFB;
-			gameMap[playerPosition[1] + 20] += shipFB;
-			playerPosition[1] += 20;
-			gameMap[playerPosition[0]] -= playerShip;
-			gameMap[playerPosition[0] + 20] += playerShip;
-			playerPosition[0] += 20;
-			animateFlag = 1;
-		}
-		return;
-	}
-
-    // if 8 key detected, move player backwards
-	if((FIO0PIN >> KeyBitsIn[1] & 1) == 1){
-		if(playerPosition[0] != 0 && playerPosition[0] != 20 && playerPosition[0] != 40 && playerPosition[0] != 60){
-			loopDebounceCount = 0;
-			gameMap[playerPosition[0]] -= playerShip;
-			gameMap[playerPosition[0] - 1] += playerShip;
-			playerPosition[0]--;
-			gameMap[playerPosition[1]] -= shipFB;
-			gameMap[playerPosition[1] - 1] += shipFB;
-			playerPosition[1]--;
-			animateFlag = 1;
-		}
-		return;
-	}
-
-    // if 5 key detected, move player up
-	if((FIO0PIN >> KeyBitsIn[2] & 1) == 1){
-		if(playerPosition[0] > 19){
-			loopDebounceCount = 0;
-			gameMap[playerPosition[1]] -= shipFB;
-			gameMap[playerPosition[1] - 20] += shipFB;
-			playerPosition[1] -= 20;
-			gameMap[playerPosition[0]] -= playerShip;
-			gameMap[playerPosition[0] -20] += playerShip;
-			playerPosition[0] -= 20;
-			animateFlag = 1;
-		}
-		return;
-	}
+// queues a key event, or counts it as dropped when the queue is full
+void keyEventPush(int key, int pressed, unsigned int time) {
+    if (keyEventHead - keyEventTail >= KEY_QUEUE_SIZE) {
+        keyEventOverflows++;
+        return;
+    }
 
-    if(loopSpam <= loopSpamMin) loopSpam++;
-    if(loopDebounceCount <= debounceTimeMin) loopDebounceCount++;
+    struct KeyEvent *event = &keyEvents[keyEventHead & (KEY_QUEUE_SIZE - 1)];
+    event->time = time;
+    event->key = key;
+    event->pressed = pressed;
+    keyEventHead++;
 }
 
 // initialize the LCD
@@ -1329,13 +2925,32 @@ void InitializeLCD(){
     configInPins();
 
     // Drive R/W, RS, and E low
-    for (int i = 0; i < 3; i++) {
-        FIO0PIN &= ~(1<<Control[i]);
-    }
+    FIO0CLR = LCD_E | LCD_E2 | LCD_RW | LCD_RS;
 
     wait_ms(4);
 
+#if LCD_BUS_4BIT
+    // the controller powers up in 8 bit mode. Three function set nibbles put it in a known
+    // state whatever mode it was in, then 0x2 switches to the 4 bit interface
+    FIO0MASK = LCD_NIBBLE_MASK;
+    LCDnibbleStrobe(LCD_E | LCD_E2, 0, 0x3);
+    wait_ms(5);
+    LCDnibbleStrobe(LCD_E | LCD_E2, 0, 0x3);
+    wait_100us();
+    LCDnibbleStrobe(LCD_E | LCD_E2, 0, 0x3);
+    wait_100us();
+    LCDnibbleStrobe(LCD_E | LCD_E2, 0, 0x2);
+    wait_100us();
+    FIO0MASK = 0;
+
+    // 4 bit interface, multiple lines, 5x8 font
+    LCDwriteCommand(0x28);
+#else
     LCDwriteCommand(0x38);
+#endif
+
+    // the busy flag can be read once the interface is set
+    lcdBusyPollMode = LCD_BUSY_POLL;
 
     // Set cursor to advance to the right after each character sent
     LCDwriteCommand(0x06);
@@ -1346,33 +2961,11 @@ void InitializeLCD(){
     // Clear display and move cursor to upper left position
     LCDwriteCommand(0x01);
 
-    wait_ms(4);
+    if(!lcdBusyPollMode) wait_ms(4);
 
-    // Defining custom character 0
-    LCDwriteCommand(0x40);
-    LCDwriteData(0b11100); //Byte 1
-    LCDwriteData(0b01110); //Byte 2
-    LCDwriteData(0b00111);
-    LCDwriteData(0b00010);
-    LCDwriteData(0b00010);
-    LCDwriteData(0b00111);
-    LCDwriteData(0b01110);
-    LCDwriteData(0b11100); //Byte 8
-
-    // Defining custom character 1
-    LCDwriteData(0b00000); //Byte 1
-    LCDwriteData(0b11100); //Byte 2
-    LCDwriteData(0b11000);
-    LCDwriteData(0b10111);
-    LCDwriteData(0b10111);
-    LCDwriteData(0b11000);
-    LCDwriteData(0b11100);
-    LCDwriteData(0b00000); //Byte 8
+    // the display is blank, sprites are loaded into CGRAM by writeDisplay as they are needed
+    resetDisplayChars();
 
-    wait_ms(4);
-
-    // create the display addresses array
-    createDispAdd();
     startGame();
 
 }
@@ -1381,52 +2974,69 @@ void InitializeLCD(){
 
 void startGame(){
 
-    // initialize the weaponsPosition array to all -1 to signify no weapons on screen
-    for(int i = 0; i < 20; i++){
-        weaponPositions[i] = -1;
-    }
+    // empty every entity pool to signify nothing on screen
+    poolReset(&weaponPool);
+    poolReset(&enemyWeaponPool);
+    poolReset(&collisionPool);
+    poolReset(&enemyPool);
+    poolReset(&flashPool);
 
-    for(int i = 0; i < 10; i++){
-    	enemyWeaponPos[i] = -1;
+    // nothing is held for a flash any more
+    for(int w = 0; w < DIRTY_WORDS; w++){
+        heldCells[w] = 0;
     }
 
-    // initialize the gamMapLast array to -1 at all positions
-    for(int i = 0; i < 80; i++){
-        gameMapLast[i] = -1;
-    }
-
-    // initialize collisionAnimAtPos to -1 at all positions
-    for(int i = 0; i < 2; i++){
-        for(int j = 0; j < 10; j++){
-            collisionAnimAtPos[i][j] = -1;
-        }
-    }
-    // initialize enemyPosFire to -1 at all positions
-    for(int i = 0; i < 2; i++){
-        for(int j = 0; j < 4; j++){
-            enemyPosFire[i][j] = -1;
-        }
-    }
-
-    // set animateFlag to 1 for initial draw
-    animateFlag= 1;
+    // redraw every location for the initial draw
+    markAllCellsDirty();
 
     // set the player position array to starting positions
-    playerPosition[0] = 20;
-    playerPosition[1] = 21;
+    playerPosition[0] = PLAYER_START;
+    playerPosition[1] = PLAYER_START + 1;
 
     // execute populateBackground function
 	populateBackground();
 }
 
+// takes the first free slot and appends it to the active list
+int poolAlloc(struct EntityPool *pool){
+    int slot = pool->freeHead;
+    if(slot < 0) return -1;
+
+    pool->freeHead = pool->link[slot];
+    pool->link[slot] = pool->count;
+    pool->active[pool->count++] = slot;
+    return slot;
+}
+
+// moves the last active slot into the hole and pushes the slot onto the free list
+void poolFree(struct EntityPool *pool, int slot){
+    int at = pool->link[slot];
+    int last = pool->active[--pool->count];
+
+    pool->active[at] = last;
+    pool->link[last] = at;
+    pool->link[slot] = pool->freeHead;
+    pool->freeHead = slot;
+}
+
+// chains every slot onto the free list in order
+void poolReset(struct EntityPool *pool){
+    pool->count = 0;
+    for(int slot = 0; slot < pool->capacity; slot++){
+        pool->link[slot] = slot + 1 < pool->capacity ? slot + 1 : -1;
+    }
+    pool->freeHead = pool->capacity > 0 ? 0 : -1;
+}
+
 // display the title screen for the game
 void displayTitleScreen() {
 
-	// Clear screen
-	for (int i = 0; i < 80; i++) {
-		LCDwriteCommand(AddressCodes[i]);
-		LCDwriteData(blank);
-	}
+	// Clear screen, one clear display command to every controller rather than a write per
+	// cell, which on the larger panels would be more entries than the LCD queue holds
+	LCDwriteCommand(0x01);
+
+	// the title text only uses ROM characters
+	resetDisplayChars();
 
 	// Write title screen
 	for (int i = 0; i < 2; i++) {
@@ -1443,134 +3053,1093 @@ void configInPins(){
     // Configure keypad inputs
     PINMODE0 |= (1 << 4) | (1 << 5);
     PINMODE0 |= (1 << 6) | (1 << 7);
+#if SOUND_DAC
+    PINMODE0 |= (1 << 22) | (1 << 23);
+#else
     PINMODE1 |= (1 << 20) | (1 << 21);
+#endif
 
 }
 
 // initialize the output pins
 void initOutPins(){
-    // Initializing pins 5 - 12
-    for (int i = 0; i < 8; i++) {
-        FIO0DIR |= (1 << DB[i]);
-    }
+    // Initializing pins 5 - 12, or only 9 - 12 for the 4 bit interface
+    FIO0DIR |= DB_BUS;
 
-    // Initializing pins 13 - 15
+    // Initializing pins 13 - 15, and pin 28 for the second E line
     for (int i = 0; i < 3; i++) {
         FIO0DIR |= (1 << Control[i]);
     }
+    FIO0DIR |= LCD_E2;
 
     // Initializing pins 16, 17, used for keypad
     for (int i = 0; i < 2; i++) {
         FIO0DIR |= (1 << KeyBitsOut[i]);
     }
+}
 
-    // Initialize pin 23 for piezo
-    FIO0DIR |= (1 << 21);
+// Timer1 counts us from PCLK through the prescaler, so the count is right at any CCLK_HZ
+void clockInitialize() {
+    T1TCR = 2;                          // Hold the timer in reset while configuring
+    T1PR = PCLK_HZ / 1000000 - 1;       // One count per us
+    T1IR = (1<<0);                      // Clear old match events
+    T1TCR = 1;                          // Start the timer
+    ISER0 = (1<<2);                     // Enable Timer1 interrupts
+
+    DEMCR |= (1<<24);                   // Enable the DWT
+    DWT_CTRL |= 1;                      // Start the cycle counter, the LCD E pulse uses it
 }
 
-// Assigning Address codes to be in order of appearance on display
-/*
- * 0  1  2  ... 19
- * 40 41 42 ... 59
- * 20 21 22 ... 39
- * 60 61 62 ... 79
- */
-void createDispAdd(){
+// us since clockInitialize
+unsigned int micros() {
+    return T1TC;
+}
+
+// waits at least us microseconds
+void delay_us(unsigned int us) {
+#ifdef HOST_SIM
+    simAdvanceUs(us);
+#else
+    unsigned int start = T1TC;
+    while(T1TC - start < us) {
+        // Do nothing
+    }
+#endif
+}
+
+// waits until the clock reaches a time, returns straight away if it already has
+void delay_until(unsigned int time) {
+    int remaining = time - micros();
+    if(remaining > 0) delay_us(remaining);
+}
+
+void wait_100us() {
+    delay_us(100);
+}
+
+void wait_ms(int ms){
+    delay_us(ms * 1000);
+}
+
+// send the write command to the display
+void LCDwriteCommand(int CommandData) {
+    lcdSelect = LCD_CMD_SELECT(CommandData);
+    if(lcdQueueRunning){
+        LCDqueuePush((CommandData & 0xFF) | (lcdSelect << LCD_Q_SELECT_SHIFT));
+        return;
+    }
+
+    // Drive RS low to indicate this is a command
+    LCDbusWrite(lcdSelect, 0, CommandData & 0xFF);
+}
 
-    for (int i = 0; i < 20; i++) {
-        AddressCodes[i] = i + 0x80;
+// send data to be written to the display
+void LCDwriteData(int ASCIIData) {
+    if(lcdQueueRunning){
+        LCDqueuePush((ASCIIData & 0xFF) | LCD_Q_RS | (lcdSelect << LCD_Q_SELECT_SHIFT));
+        return;
     }
 
-    for (int i = 20; i < 40; i++) {
-        AddressCodes[i] = i + 44 + 0x80;
+    // Drive RS high to indicate this is data
+    LCDbusWrite(lcdSelect, 1, ASCIIData);
+}
+
+// sends one byte and waits until the controllers are done with it
+void LCDbusWrite(int select, int rs, int value) {
+    LCDbusStrobe(LCD_ENABLE_PINS(select), rs, value);
+
+    // in busy flag mode the flag tells us when the controller has finished. Two controllers
+    // cannot drive the bus at once, so each one is asked in turn
+    if(lcdBusyPollMode){
+        int ready = 1;
+        if(select & 1) ready = LCDwaitReady(LCD_E);
+        if(ready && (select & 2)) ready = LCDwaitReady(LCD_E2);
+        if(ready) return;
+
+        // the controller never answered, go back to fixed delays for good
+        lcdBusyTimeouts++;
+        lcdBusyPollMode = 0;
+    }
+
+    // Wait 200 us
+    wait_100us();
+    wait_100us();
+}
+
+// drives DB0-DB7, R/W and RS with one clear store and one set store using the
+// DBSetMasks table, then generates the pulse on the E pins given. The 4 bit interface
+// sends the high nibble and then the low nibble, each with one masked store, and sets
+// FIO0MASK once around the pair
+void LCDbusStrobe(int enable, int rs, int value) {
+#if LCD_BUS_4BIT
+    FIO0MASK = LCD_NIBBLE_MASK;
+    LCDnibbleStrobe(enable, rs, (value >> 4) & 0x0F);
+    LCDnibbleStrobe(enable, rs, value & 0x0F);
+    FIO0MASK = 0;
+#else
+    unsigned int setBits = DBSetMasks[value & 0xFF];
+
+    // clear the DB pins that are zero in this byte along with R/W, and RS for a command
+    FIO0CLR = (DB_ALL & ~setBits) | LCD_RW | (rs ? 0 : LCD_RS);
+
+    // set the DB pins that are one in this byte, and RS for data
+    FIO0SET = setBits | (rs ? LCD_RS : 0);
+
+    // Drive E high, then low to generate the pulse, holding each long enough for the
+    // controller at any CCLK_HZ
+    FIO0SET = enable;
+    LCDenableHold();
+    FIO0CLR = enable;
+    LCDenableHold();
+
+#ifdef HOST_SIM
+    simLCDstrobe(enable, rs, value & 0xFF);
+#endif
+#endif
+}
+
+// drives DB4-DB7, R/W and RS from the DBNibbleMasks table with a single FIO0PIN store,
+// which also leaves E low, then pulses E. The caller sets FIO0MASK to LCD_NIBBLE_MASK
+// first so every other pin on the port keeps its value, and clears it afterwards since
+// it also applies to FIO0SET and FIO0CLR. Nothing else writes the port while the mask
+// is up: before the queue runs only the main code drives it, and after that only
+// TIMER1_IRQHandler does
+void LCDnibbleStrobe(int enable, int rs, int nibble) {
+    FIO0PIN_MASKED(DBNibbleMasks[nibble & 0x0F] | (rs ? LCD_RS : 0));
+
+    FIO0SET = enable;
+    LCDenableHold();
+    FIO0CLR = enable;
+    LCDenableHold();
+
+#ifdef HOST_SIM
+    simLCDnibble(enable, rs, nibble & 0x0F);
+#endif
+}
+
+// writes every cell twice, first with a set address command per cell and then as one
+// run in DDRAM order, timing both on the us clock. The queue is bypassed so the figures
+// are what the bus and controller can do
+void LCDbenchmark() {
+    int queueWasRunning = lcdQueueRunning;
+    lcdQueueRunning = 0;
+
+    unsigned int start = micros();
+    for (int i = 0; i < LCD_CELLS; i++) {
+        LCDwriteCommand(AddressCodes[i]);
+        LCDwriteData(0xFF);
     }
+    unsigned int elapsed = micros() - start;
+    if (elapsed > 0) lcdBenchCellsPerSec = LCD_CELLS * 1000000 / elapsed;
+
+    start = micros();
+    LCDwriteCommand(AddressCodes[displayOrder[0]]);
+    for (int k = 0; k < LCD_CELLS; k++) {
+        if (k > 0 && AddressCodes[displayOrder[k]] != AddressCodes[displayOrder[k - 1]] + 1) {
+            LCDwriteCommand(AddressCodes[displayOrder[k]]);
+        }
+        LCDwriteData(blank);
+    }
+    elapsed = micros() - start;
+    if (elapsed > 0) lcdBenchRunCellsPerSec = LCD_CELLS * 1000000 / elapsed;
+
+    lcdQueueRunning = queueWasRunning;
+}
+
+// the us clock keeps running, MR0 schedules the next LCD transfer
+void LCDqueueInitialize() {
+    T1IR = (1<<0);                      // Clear old MR0 match events
+    T1MCR |= (1<<0);                    // Interrupt on MR0 match
+
+    lcdQueueRunning = 1;
+}
 
-    for (int i = 40; i < 60; i++) {
-        AddressCodes[i] = i - 20 + 0x80;
+// adds an entry to the LCD queue. When the queue is full the game waits for the
+// interrupt to make room, so nothing is ever dropped
+void LCDqueuePush(int entry) {
+    if(lcdQueueHead - lcdQueueTail >= LCD_QUEUE_SIZE){
+        lcdQueueOverflows++;
+        while(lcdQueueHead - lcdQueueTail >= LCD_QUEUE_SIZE) {
+            // wait for TIMER1_IRQHandler
+#ifdef HOST_SIM
+            simAdvanceUs(LCD_EXEC_US);
+#endif
+        }
     }
 
-    for (int i = 60; i < 80; i++) {
-        AddressCodes[i] = i + 24 + 0x80;
+    lcdQueue[lcdQueueHead & (LCD_QUEUE_SIZE - 1)] = entry;
+    lcdQueueHead++;
+
+    int depth = lcdQueueHead - lcdQueueTail;
+    if(depth > lcdQueueHighWater) lcdQueueHighWater = depth;
+
+    // wake the interrupt if it ran out of work. The match is set a few us ahead
+    // so the timer cannot pass it before the store lands
+    if(lcdQueueIdle){
+        lcdQueueIdle = 0;
+        T1MR0 = T1TC + 10;
     }
 }
 
-// Approximately 37 ticks in 100 us
-void wait_100us() {
-    volatile int count;
-    int wait_ticks = 37;
-    for (count = 0; count < wait_ticks; count++) {
-        // Do nothing
+// the us clock keeps running, MR2 raises tickCount every TICK_US
+void tickInitialize() {
+    T1MR2 = T1TC + TICK_US;             // 1st tick one tick from now
+    T1IR = (1<<2);                      // Clear old MR2 match events
+    T1MCR |= (1<<6);                    // Interrupt on MR2 match
+}
+
+// sleeps until tickCount moves on from a tick. Interrupts are masked around the check so
+// a tick landing just before the WFI still wakes it, the pending interrupt runs once they
+// are unmasked again
+void waitForTick(unsigned int tick) {
+    while(tickCount == tick) {
+#ifdef HOST_SIM
+        simWaitForInterrupt();
+#else
+        __asm volatile ("cpsid i");
+        if(tickCount == tick) __asm volatile ("wfi");
+        __asm volatile ("cpsie i");
+#endif
     }
 }
 
-// wait function based on individual system ticks
-void wait_ticks(int tick){
-	volatile int count;
-	for (count = 0; count < tick; count++) {
-	        // Do nothing
+// counts game ticks on MR2 and scans the keypad on MR3. Sends one queued LCD entry per MR0
+// match and sets the next match for when the controller will be ready again. In busy flag
+// mode the entry only goes once its controllers read ready, a busy one is read again
+// LCD_POLL_US later, and one still busy after LCD_BUSY_TIMEOUT_US turns polling off
+void TIMER1_IRQHandler() {
+	if ((T1IR>>2) & 1) {                // check for MR2 event
+		T1IR = (1<<2);                  // clear MR2 event
+		T1MR2 = T1MR2 + TICK_US;        // next tick a whole tick after this one
+		tickCount++;
+	}
+
+	if ((T1IR>>3) & 1) {                // check for MR3 event
+		T1IR = (1<<3);                  // clear MR3 event
+		T1MR3 = T1MR3 + KEY_SCAN_US;    // next scan a whole scan after this one
+		unsigned int start = DWT_CYCCNT;
+		keypadScan();
+		unsigned int cycles = DWT_CYCCNT - start;
+		if(cycles > keyScanMaxCycles) keyScanMaxCycles = cycles;
+	}
+
+	if ((T1IR>>0) & 1) {                // check for MR0 event
+		T1IR = (1<<0);                  // clear MR0 event
+
+        // nothing left to send, the next push restarts the match
+		if(lcdQueueTail == lcdQueueHead){
+			lcdQueueIdle = 1;
+			return;
+		}
+
+		int entry = lcdQueue[lcdQueueTail & (LCD_QUEUE_SIZE - 1)];
+		int select = entry >> LCD_Q_SELECT_SHIFT;
+
+		if(lcdBusyPollMode){
+			int busy = ((select & 1) && LCDreadBusy(LCD_E)) || ((select & 2) && LCDreadBusy(LCD_E2));
+			if(busy){
+				if(!lcdQueueWaiting){
+					lcdQueueWaiting = 1;
+					lcdQueueWaitStart = T1TC;
+				}
+				if(T1TC - lcdQueueWaitStart < LCD_BUSY_TIMEOUT_US){
+					T1MR0 = T1TC + LCD_POLL_US;
+					return;
+				}
+
+				// the controller never answered, go back to fixed pacing for good
+				lcdBusyTimeouts++;
+				lcdBusyPollMode = 0;
+			}
+			lcdQueueWaiting = 0;
+		}
+		lcdQueueTail++;
+
+		int value = entry & 0xFF;
+		int rs = (entry & LCD_Q_RS) ? 1 : 0;
+		LCDbusStrobe(LCD_ENABLE_PINS(select), rs, value);
+
+		// the busy flag says when the controller is done
+		if(lcdBusyPollMode){
+			T1MR0 = T1TC + LCD_POLL_US;
+		}
+
+        // clear display and return home take much longer than everything else
+		else if(!rs && (value == 0x01 || (value & 0xFE) == 0x02)){
+			T1MR0 = T1TC + LCD_EXEC_LONG_US;
+		}
+		else {
+			T1MR0 = T1TC + LCD_EXEC_US;
+		}
 	}
 }
 
-// Call wait_100us() 10 times per ms
-void wait_ms(int ms){
-    for(int i = 0; i < ms * 10; i++){
-        wait_100us();
+// reads the busy flag of the controller on one E pin until it drops. Returns 1 when the
+// LCD is ready, 0 once LCD_BUSY_TIMEOUT_US has gone by
+int LCDwaitReady(int enable) {
+    int busy;
+    unsigned int start = micros();
+
+    do {
+        busy = LCDreadBusy(enable);
+    } while(busy && micros() - start < LCD_BUSY_TIMEOUT_US);
+
+    return !busy;
+}
+
+// switches the DB pins to inputs, raises R/W and reads the busy flag of the controller on
+// one E pin, then goes back to writing. Returns 1 while the controller is busy
+int LCDreadBusy(int enable) {
+
+    // release the DB pins so the controller can drive them
+    FIO0DIR &= ~DB_BUS;
+
+    // RS low and R/W high reads the busy flag and address counter
+    FIO0CLR = LCD_RS;
+    FIO0SET = LCD_RW;
+
+    int busy = LCDreadBusyFlag(enable);
+    FIO0CLR = enable;
+    LCDenableHold();
+
+#if LCD_BUS_4BIT
+    // the low nibble of the address counter has to be clocked out too
+    FIO0SET = enable;
+    LCDenableHold();
+    FIO0CLR = enable;
+    LCDenableHold();
+#endif
+
+    // back to writing
+    FIO0CLR = LCD_RW;
+    FIO0DIR |= DB_BUS;
+
+    return busy;
+}
+
+// raise E1 or E2 and read DB7 while it is high, the hold gives the controller its data
+// delay time. The caller lowers E again
+int LCDreadBusyFlag(int enable) {
+    FIO0SET = enable;
+#ifdef HOST_SIM
+    return simLCDreadBusyFlag(enable);
+#else
+    LCDenableHold();
+    return (FIO0PIN >> DB[7]) & 1;
+#endif
+}
+
+// the emulator does not model E timing, so the host build does not spin
+void LCDenableHold() {
+#ifndef HOST_SIM
+    unsigned int start = DWT_CYCCNT;
+    while(DWT_CYCCNT - start < LCD_E_HOLD_CYCLES);
+#endif
+}
+
+#ifdef HOST_SIM
+// Host emulator of the HD44780, one per controller on the panel. Each models DDRAM with
+// the two line layout (0x00-0x27 and 0x40-0x67), CGRAM, entry mode, the address counter,
+// the 8 and 4 bit interfaces and each instruction's execution time against the
+// simulated us clock. It counts bus transfers and modeled bus time so display
+// changes can be measured, and flags transfers sent while a controller was busy.
+// Setting simLCDstuckBusy models a display that never answers
+
+#define SIM_LCD_READ_US 2
+
+// us an E pulse takes, the 1000 ns minimum enable cycle. The 4 bit interface needs two
+// pulses a byte, so this is what separates the interfaces in LCDbenchmark
+#define SIM_LCD_PULSE_US 1
+
+// state of one controller. Every field is zero at power on
+struct SimLCD {
+    unsigned char ddram[128];
+    unsigned char cgram[64];
+    int address;                // address counter
+    int inCgram;                // 1 when the address counter points into CGRAM
+    int decrement;              // entry mode I/D, clear to increment
+    int displayOn;
+    int fourBit;                // the controller powers up with the 8 bit interface
+    int haveNibble;             // 1 when the first half of a byte has arrived on the 4 bit interface
+    int nibble;
+    unsigned int busyUntil;
+};
+
+struct SimLCD simLCD[LCD_CONTROLLERS];
+int simLCDstuckBusy = 0;
+
+// set while simTimer1Match runs the handler. Handlers take no time on the host, so busy
+// flag reads from the LCD queue do not move the clock
+int simInterrupt = 0;
+
+// totals since boot
+int simLCDstrobes = 0;
+int simLCDbusyReads = 0;
+int simLCDoverruns = 0;
+unsigned int simLCDbusUs = 0;
+
+// totals since simLCDframeReset
+int simLCDframeTransfers = 0;
+unsigned int simLCDframeBusUs = 0;
+
+// moves the address counter on after a read or write, following the two line DDRAM layout
+void simLCDstep(struct SimLCD *lcd, int decrement) {
+    if(lcd->inCgram){
+        lcd->address = (lcd->address + (decrement ? -1 : 1)) & 0x3F;
+        return;
+    }
+    if(!decrement){
+        lcd->address++;
+        if(lcd->address == 0x28) lcd->address = 0x40;
+        else if(lcd->address == 0x68) lcd->address = 0x00;
+    }
+    else {
+        lcd->address--;
+        if(lcd->address == 0x3F) lcd->address = 0x27;
+        else if(lcd->address < 0) lcd->address = 0x67;
     }
 }
 
-// send the write command to the display
-void LCDwriteCommand(int CommandData) {
+// runs one complete instruction or data write and returns its execution time in us
+int simLCDexecute(struct SimLCD *lcd, int rs, int value) {
+    if(rs){
+        if(lcd->inCgram) lcd->cgram[lcd->address] = value & 0x1F;
+        else lcd->ddram[lcd->address] = value;
+        simLCDstep(lcd, lcd->decrement);
+        return 41;
+    }
 
-    // Update DB0-DB7 to match command code
-    for (int i = 0; i < 8; i++) {
-        if ((CommandData >> i) & 1) {
-            FIO0PIN |= (1<<DB[i]);
+    // set DDRAM address
+    if(value & 0x80){
+        lcd->address = value & 0x7F;
+        lcd->inCgram = 0;
+    }
+
+    // set CGRAM address
+    else if(value & 0x40){
+        lcd->address = value & 0x3F;
+        lcd->inCgram = 1;
+    }
+
+    // function set, only the interface width matters here
+    else if(value & 0x20){
+        lcd->fourBit = !((value >> 4) & 1);
+    }
+
+    // cursor or display shift, only cursor moves are modeled
+    else if(value & 0x10){
+        if(!(value & 0x08)){
+            simLCDstep(lcd, !((value >> 2) & 1));
+        }
+    }
+
+    // display on/off control
+    else if(value & 0x08){
+        lcd->displayOn = (value >> 2) & 1;
+    }
+
+    // entry mode set, display shift is not modeled
+    else if(value & 0x04){
+        lcd->decrement = !((value >> 1) & 1);
+    }
+
+    // return home
+    else if(value & 0x02){
+        lcd->address = 0;
+        lcd->inCgram = 0;
+        return 1520;
+    }
+
+    // clear display
+    else if(value & 0x01){
+        for(int i = 0; i < 128; i++) lcd->ddram[i] = 0x20;
+        lcd->address = 0;
+        lcd->inCgram = 0;
+        lcd->decrement = 0;
+        return 1520;
+    }
+    return 37;
+}
+
+// a byte reaching one controller
+void simLCDtransfer(struct SimLCD *lcd, int rs, int value) {
+    if((int)(lcd->busyUntil - T1TC) > 0) simLCDoverruns++;
+
+    int execUs = simLCDexecute(lcd, rs, value);
+    lcd->busyUntil = T1TC + execUs;
+    simLCDbusUs += execUs;
+    simLCDframeBusUs += execUs;
+}
+
+// one E pulse, counted once however many controllers it reaches
+void simLCDpulse(void) {
+    simLCDstrobes++;
+    simLCDframeTransfers++;
+    if(!simInterrupt) simAdvanceUs(SIM_LCD_PULSE_US);
+}
+
+// a full byte from the 8 bit interface to the controllers on the E pins given
+void simLCDstrobe(int enable, int rs, int value) {
+    simLCDpulse();
+    for(int c = 0; c < LCD_CONTROLLERS; c++){
+        if(enable & LCD_ENABLE_PINS(1 << c)) simLCDtransfer(&simLCD[c], rs, value);
+    }
+}
+
+// a nibble on DB4-DB7. While a controller is in 8 bit mode DB0-DB3 read as zero
+// and each nibble is a whole instruction, afterwards two nibbles make a byte
+void simLCDnibble(int enable, int rs, int nibble) {
+    simLCDpulse();
+    for(int c = 0; c < LCD_CONTROLLERS; c++){
+        struct SimLCD *lcd = &simLCD[c];
+        if(!(enable & LCD_ENABLE_PINS(1 << c))) continue;
+
+        if(!lcd->fourBit){
+            simLCDtransfer(lcd, rs, nibble << 4);
+        }
+        else if(!lcd->haveNibble){
+            lcd->nibble = nibble;
+            lcd->haveNibble = 1;
         }
         else {
-            FIO0PIN &= ~(1<<DB[i]);
+            simLCDtransfer(lcd, rs, (lcd->nibble << 4) | nibble);
+            lcd->haveNibble = 0;
         }
     }
+}
 
-    // Drive R/W low
-    FIO0PIN &= ~(1<<Control[1]);
+// the busy flag of the controller on an E pin
+int simLCDreadBusyFlag(int enable) {
+    simLCDbusyReads++;
+    if(!simInterrupt) simAdvanceUs(SIM_LCD_READ_US);
+    if(simLCDstuckBusy) return 1;
 
-    // Drive RS low to indicate this is a command
-    FIO0PIN &= ~(1<<Control[2]);
+    struct SimLCD *lcd = &simLCD[(enable & LCD_E) ? 0 : 1];
+    return (int)(lcd->busyUntil - T1TC) > 0;
+}
 
-    // Drive E high, then low to generate the pulse
-    FIO0PIN |= (1<<Control[0]);
-    wait_100us();
-    FIO0PIN &= ~(1<<Control[0]);
+// starts a new measurement for simLCDframeTransfers and simLCDframeBusUs
+void simLCDframeReset() {
+    simLCDframeTransfers = 0;
+    simLCDframeBusUs = 0;
+}
 
-    // Wait 100 us
-    wait_100us();
+// character code shown at a line and column of the panel
+int simLCDcharAt(int row, int col) {
+    return simLCD[LCD_ROW_CONTROLLER(row)].ddram[LCD_ROW_BASE(row) + col];
 }
 
-// send data to be written to the display
-void LCDwriteData(int ASCIIData) {
+// copies the visible grid as text. CGRAM characters come out as '0' to '7'
+// and anything outside printable ASCII as '?'
+void simLCDgrid(char grid[LCD_ROWS][LCD_COLS + 1]) {
+    for(int row = 0; row < LCD_ROWS; row++){
+        for(int col = 0; col < LCD_COLS; col++){
+            int c = simLCDcharAt(row, col);
+            if(c < 8) grid[row][col] = '0' + c;
+            else if(c < 0x20 || c > 0x7E) grid[row][col] = '?';
+            else grid[row][col] = c;
+        }
+        grid[row][LCD_COLS] = 0;
+    }
+}
 
-    // Update DB0-DB7 to match data (ASCII) code
-    for (int i = 0; i < 8; i++) {
-        if ((ASCIIData >> i) & 1) {
-            FIO0PIN |= (1<<DB[i]);
+// there are no interrupts on the host, this stands in for Timer1 reaching MR0, MR2 or MR3
+void simTimer1Match(int match) {
+    T1TC = match == 0 ? T1MR0 : match == 2 ? T1MR2 : T1MR3;
+    T1IR = (1<<match);
+    simInterrupt = 1;
+    TIMER1_IRQHandler();
+    simInterrupt = 0;
+}
+
+// true when an enabled match falls between the clock and a time
+int simMatchDue(int enabled, unsigned int match, unsigned int limit) {
+    return enabled && (int)(match - T1TC) >= 0 && (int)(limit - match) >= 0;
+}
+
+// moves the simulated us clock forward, running the LCD queue, tick and keypad matches
+// that fall inside the step in time order, MR0 first on a tie. Every delay on the host
+// goes through here
+void simAdvanceUs(unsigned int us) {
+    unsigned int target = T1TC + us;
+    while(1) {
+        int match = -1;
+        unsigned int limit = target;
+        if(simMatchDue(!lcdQueueIdle, T1MR0, limit)) {
+            match = 0;
+            limit = T1MR0;
         }
-        else {
-            FIO0PIN &= ~(1<<DB[i]);
+        if(simMatchDue((T1MCR >> 6) & 1, T1MR2, limit) && (match < 0 || T1MR2 != limit)) {
+            match = 2;
+            limit = T1MR2;
+        }
+        if(simMatchDue((T1MCR >> 9) & 1, T1MR3, limit) && (match < 0 || T1MR3 != limit)) {
+            match = 3;
+            limit = T1MR3;
         }
+
+        if(match < 0) break;
+        simTimer1Match(match);
     }
+    T1TC = target;
+}
 
-    // Drive R/W low
-    FIO0PIN &= ~(1<<Control[1]);
+// stands in for WFI, moves the clock on to the next Timer1 match
+void simWaitForInterrupt() {
+    unsigned int next = T1TC + TICK_US;
+    if(((T1MCR >> 6) & 1) && (int)(T1MR2 - T1TC) >= 0) next = T1MR2;
+    if(!lcdQueueIdle && (int)(T1MR0 - T1TC) >= 0 && (int)(next - T1MR0) > 0) next = T1MR0;
+    if(((T1MCR >> 9) & 1) && (int)(T1MR3 - T1TC) >= 0 && (int)(next - T1MR3) > 0) next = T1MR3;
+    simAdvanceUs(next - T1TC);
+}
 
-    // Drive RS high to indicate this is data
-    FIO0PIN |= (1<<Control[2]);
+// Host stand-in for the keypad. simKeys is a mask of the keys held down, and the inputs
+// follow it through the output keypadScan drove last
+int simKeys = 0;
+int simKeypadColumn = 0;
 
-    // Drive E high, then low to generate the pulse
-    FIO0PIN |= (1<<Control[0]);
-    wait_100us();
-    FIO0PIN &= ~(1<<Control[0]);
+// sets the keypad inputs from simKeys for the output driven
+void simKeypadDrive(int column) {
+    int rows = (simKeys >> (column * 3)) & 7;
+    simKeypadColumn = column;
 
-    // Wait 100 us
-    wait_100us();
+    unsigned int pins = FIO0PIN;
+    for(int i = 0; i < 3; i++) {
+        if(rows >> i & 1) pins |= 1 << KeyBitsIn[i];
+        else pins &= ~(1 << KeyBitsIn[i]);
+    }
+    FIO0PIN = pins;
+}
+
+// presses and releases keys
+void simKeypadSet(int keys) {
+    simKeys = keys;
+    simKeypadDrive(simKeypadColumn);
+}
+#if SOUND_DAC
+// Host stand-in for the DAC and GPDMA channel 0. Each sample the DAC timer would ask for
+// moves one word from the current link into DACR, and the end of a link raises the
+// terminal count interrupt. The 32 bit channel registers cannot hold host pointers, so
+// the mock follows dacLinks itself from dacLinks[0], where dacInitialize starts the channel
+const struct DmaLink *simDmaLink = 0;
+unsigned int simDmaWords = 0;           // words moved from the current link
+unsigned int simDacSamples = 0;         // total samples output
+
+// runs the DAC for a number of samples
+void simDacRun(unsigned int samples) {
+    if(!(DMACC0Config & 1) || !((DACCTRL >> 3) & 1)) return;
+    if(!simDmaLink) simDmaLink = &dacLinks[0];
+
+    while(samples--) {
+        DACR = ((const unsigned int *) simDmaLink->source)[simDmaWords];
+        simDacSamples++;
+        if(++simDmaWords < (simDmaLink->control & 0xFFF)) continue;
+
+        simDmaWords = 0;
+        int interrupt = simDmaLink->control >> 31;
+        simDmaLink = (const struct DmaLink *) simDmaLink->next;
+        if(interrupt) {
+            DMACIntTCStat = (1<<0);
+            DMA_IRQHandler();
+            DMACIntTCStat = 0;
+        }
+    }
+}
+#endif
+
+#ifdef HOST_TEST
+// Host test driver. It boots the game the way main does and then plays it through the
+// keypad mock, checking what the emulated panel shows, what each redraw costs on the
+// bus and how the keypad debounces. Every failed check is printed and the run carries
+// on, the exit status is nonzero if any failed
+int testFailures = 0;
+
+// prints a failed check
+void testCheck(int ok, const char *what, int line) {
+    if(ok) return;
+    printf("FinalProject.c:%d: check failed: %s\n", line, what);
+    testFailures++;
+}
+#define TEST_CHECK(cond) testCheck((cond) != 0, #cond, __LINE__)
+
+// prints the panel as text
+void testShowPanel() {
+    char grid[LCD_ROWS][LCD_COLS + 1];
+    simLCDgrid(grid);
+    for(int row = 0; row < LCD_ROWS; row++){
+        printf("|%s|\n", grid[row]);
+    }
+}
+
+// runs the main loop for a number of ticks
+void testRun(int ticks) {
+    for(int t = 0; t < ticks; t++){
+        runSimulation();
+        renderFrame();
+        updateRates();
+        waitForTick(schedulerTick);
+    }
+}
+
+// lets the LCD queue send everything it holds
+void testDrain() {
+    while(!lcdQueueIdle) simWaitForInterrupt();
 }
 
+// holds keys down for a number of ticks, lets go and runs until a move pressed during
+// the lock out of the last one has had its turn
+void testPress(int keys, int ticks) {
+    simKeypadSet(keys);
+    testRun(ticks);
+    simKeypadSet(0);
+    testRun(KEY_REPEAT_TICKS);
+}
+
+// draws every cell that is still dirty, however many frames it takes, with the game
+// stopped so nothing new changes in between
+void testFlush() {
+    if(titleScreenFlag){
+        testDrain();
+        return;
+    }
+    unsigned int dirty;
+    do {
+        testDrain();
+        writeDisplay();
+        testDrain();
+        dirty = 0;
+        for(int w = 0; w < DIRTY_WORDS; w++){
+            dirty |= dirtyCells[w] & ~heldCells[w];
+        }
+    } while(dirty);
+}
+
+// true when every cell the game is not holding shows the sprite for its gameMap value
+int testPanelMatches() {
+    for(int k = 0; k < LCD_CELLS; k++){
+        if(heldCells[k >> 5] >> (k & 31) & 1) continue;
+        int i = displayOrder[k];
+        if(displaySprites[i] != cellGlyph(i)) return 0;
+        if(simLCDcharAt(LOCATION_ROW(i), LOCATION_COLUMN(i)) != displayChars[i]) return 0;
+    }
+    return 1;
+}
+
+// after boot the panel shows the two title lines and nothing else, and drawing them fits
+// in the LCD queue
+void testTitle() {
+    testRun(100);
+    testDrain();
+
+    unsigned char expected[LCD_CELLS];
+    memset(expected, blank, sizeof(expected));
+    for(int i = 0; i < 2; i++){
+        for(int j = 0; j < 16; j++){
+            expected[titleScreenPositions[i] + j] = titleScreenChars[i][j];
+        }
+    }
+    int wrong = 0;
+    for(int i = 0; i < LCD_CELLS; i++){
+        if(simLCDcharAt(LOCATION_ROW(i), LOCATION_COLUMN(i)) != expected[i]) wrong++;
+    }
+    TEST_CHECK(wrong == 0);
+    TEST_CHECK(titleScreenFlag);
+    TEST_CHECK(lcdQueueOverflows == 0);
+    TEST_CHECK(simLCDoverruns == 0);
+    if(wrong) testShowPanel();
+}
+
+// a key has to read the same for four whole keypad scans, 6 to 8 ms, before it changes.
+// Shorter glitches never reach keysDown or keyEvents
+void testDebounce() {
+    unsigned int events = keyEventHead;
+
+    simKeypadSet(1 << KEY_8);
+    simAdvanceUs(3 * KEY_SCAN_US);
+    simKeypadSet(0);
+    simAdvanceUs(20 * KEY_SCAN_US);
+    TEST_CHECK(keysDown == 0);
+    TEST_CHECK(keyEventHead == events);
+
+    simKeypadSet(1 << KEY_8);
+    simAdvanceUs(5 * KEY_SCAN_US);
+    TEST_CHECK(keysDown == 0);
+    simAdvanceUs(4 * KEY_SCAN_US);
+    TEST_CHECK(keysDown == 1 << KEY_8);
+    simAdvanceUs(20 * KEY_SCAN_US);
+
+    simKeypadSet(0);
+    simAdvanceUs(5 * KEY_SCAN_US);
+    TEST_CHECK(keysDown == 1 << KEY_8);
+    simAdvanceUs(4 * KEY_SCAN_US);
+    TEST_CHECK(keysDown == 0);
+
+    // one press and one release, in that order
+    TEST_CHECK(keyEventHead - events == 2);
+    struct KeyEvent *press = &keyEvents[events & (KEY_QUEUE_SIZE - 1)];
+    struct KeyEvent *release = &keyEvents[(events + 1) & (KEY_QUEUE_SIZE - 1)];
+    TEST_CHECK(press->key == KEY_8 && press->pressed);
+    TEST_CHECK(release->key == KEY_8 && !release->pressed);
+    TEST_CHECK(release->time - press->time >= 20 * KEY_SCAN_US);
+    TEST_CHECK(keyEventOverflows == 0);
+}
+
+// # on the title screen starts a game with the player at the start of line 1, and once
+// drawn the panel shows the gameMap
+void testStart() {
+    testPress(1 << KEY_HASH, 20);
+    TEST_CHECK(!titleScreenFlag);
+    TEST_CHECK(playerPosition[0] == PLAYER_START);
+    TEST_CHECK(cellShip(PLAYER_START) == playerShip);
+    testFlush();
+    TEST_CHECK(testPanelMatches());
+    if(!testPanelMatches()) testShowPanel();
+}
+
+// a tap of 9 moves the ship a column forward and a tap of 5 a line up. The cells it left
+// are redrawn without it
+void testMove() {
+    int rear = playerPosition[0];
+
+    testPress(1 << KEY_9, 20);
+    TEST_CHECK(playerPosition[0] == rear + 1);
+    testPress(1 << KEY_5, 20);
+    TEST_CHECK(playerPosition[0] == rear + 1 - LCD_COLS);
+
+    testFlush();
+    TEST_CHECK(cellShip(rear) == 0);
+    TEST_CHECK(cellShip(playerPosition[0]) == playerShip);
+    TEST_CHECK(testPanelMatches());
+    if(!testPanelMatches()) testShowPanel();
+}
+
+// E pulses per byte on the LCD bus, simLCDframeTransfers counts pulses
+#define TEST_PULSES (LCD_BUS_4BIT ? 2 : 1)
+
+// what a redraw costs on the bus. Nothing changed sends nothing, one cell is a set address
+// and a byte, the cell after it adds one byte, and a cell further along either one byte
+// per cell in between or a new set address. The whole panel is drawn in runs, which
+// restart for each priority and each frame, so it costs a little over a byte a cell
+void testRedraw() {
+    testFlush();
+    int cell = (LCD_ROWS - 1) * LCD_COLS + 4;
+
+    simLCDframeReset();
+    writeDisplay();
+    testDrain();
+    TEST_CHECK(simLCDframeTransfers == 0);
+
+    simLCDframeReset();
+    markCellDirty(cell);
+    writeDisplay();
+    testDrain();
+    TEST_CHECK(simLCDframeTransfers == 2 * TEST_PULSES);
+
+    simLCDframeReset();
+    markCellDirty(cell);
+    markCellDirty(cell + 1);
+    writeDisplay();
+    testDrain();
+    TEST_CHECK(simLCDframeTransfers == 3 * TEST_PULSES);
+
+    simLCDframeReset();
+    markCellDirty(cell);
+    markCellDirty(cell + 3);
+    writeDisplay();
+    testDrain();
+    TEST_CHECK(simLCDframeTransfers == 4 * TEST_PULSES);
+    TEST_CHECK(renderDeferredCells == 0);
+
+    // only a redraw that runs out of budget leaves cells for later
+    int deferred = renderDeferredTotal;
+    int frames = framesPresented;
+    unsigned int start = micros();
+    simLCDframeReset();
+    markAllCellsDirty();
+    testFlush();
+    frames = framesPresented - frames;
+    printf("full redraw: %d transfers in %d frames, %u us of bus time, on the panel in %u us\n",
+           simLCDframeTransfers, frames, simLCDframeBusUs, micros() - start);
+    TEST_CHECK(simLCDframeTransfers >= LCD_CELLS * TEST_PULSES);
+    TEST_CHECK(simLCDframeTransfers <= LCD_CELLS * 3 / 2 * TEST_PULSES);
+    TEST_CHECK((renderDeferredTotal > deferred) == (frames > 1));
+    TEST_CHECK(renderDeferredCells == 0);
+    TEST_CHECK(testPanelMatches());
+}
+
+// random play through spawns, shots, collisions, game overs and restarts. Every so often
+// the game is stopped and the panel has to match the gameMap
+void testPlay() {
+    int keys = 0;
+    int games = 0;
+    int checks = 0;
+    int wasTitle = titleScreenFlag;
+    srand(3);
+
+    // framesPerSec from the last whole second spent playing
+    int playFps = 0;
+    int titleInWindow = 1;
+    unsigned int window = rateWindowStart;
+
+    for(int t = 0; t < 60000; t++){
+        if(t % 40 == 0){
+            int r = rand() % 30;
+            keys = 0;
+            if(titleScreenFlag) keys = t % 3000 < 40 ? 1 << KEY_HASH : 0;
+            else if(r < 5) keys = 1 << KEY_HASH;
+            else if(r < 7) keys = 1 << KEY_9;
+            else if(r < 9) keys = 1 << KEY_8;
+            else if(r < 10) keys = 1 << KEY_0;
+            else if(r < 11) keys = 1 << KEY_5;
+            simKeypadSet(keys);
+        }
+        testRun(1);
+        if(wasTitle && !titleScreenFlag) games++;
+        wasTitle = titleScreenFlag;
+
+        if(rateWindowStart != window){
+            if(!titleInWindow) playFps = framesPerSec;
+            window = rateWindowStart;
+            titleInWindow = 0;
+        }
+        titleInWindow |= titleScreenFlag;
+
+        if(t % 500 == 0 && !titleScreenFlag){
+            testFlush();
+            TEST_CHECK(testPanelMatches());
+            checks++;
+        }
+    }
+    simKeypadSet(0);
+
+    printf("random play: %d games, %d panel checks, %d steps/s, %d fps\n",
+           games, checks, simStepsPerSec, playFps);
+    TEST_CHECK(games >= 2);
+    TEST_CHECK(playFps > 0);
+    TEST_CHECK(simLCDoverruns == 0);
+    TEST_CHECK(lcdQueueOverflows == 0);
+    TEST_CHECK(keyEventOverflows == 0);
+    TEST_CHECK(lcdBusyPollMode == LCD_BUSY_POLL);
+    TEST_CHECK(lcdBusyTimeouts == 0);
+}
+
+#if LCD_BENCHMARK
+// runs the driver benchmark the way main does at boot. Build it with each LCD_BUS_4BIT
+// setting to compare the interfaces. Writing in DDRAM runs has to beat an address a cell
+void testBenchmark() {
+    LCDbenchmark();
+    printf("benchmark, %d bit bus: %d cells/s with an address a cell, %d cells/s in runs\n",
+           LCD_BUS_4BIT ? 4 : 8, lcdBenchCellsPerSec, lcdBenchRunCellsPerSec);
+    TEST_CHECK(lcdBenchCellsPerSec > 0);
+    TEST_CHECK(lcdBenchRunCellsPerSec > lcdBenchCellsPerSec);
+    TEST_CHECK(simLCDoverruns == 0);
+}
+#endif
+
+#if LCD_BUSY_POLL
+// a display that never answers the busy flag. InitializeLCD gives up on it after one
+// LCD_BUSY_TIMEOUT_US poll and finishes on the fixed delays, with the panel set up
+void testStuckBusyInit() {
+    simLCDstuckBusy = 1;
+    unsigned int start = micros();
+    InitializeLCD();
+    unsigned int elapsed = micros() - start;
+    simLCDstuckBusy = 0;
+
+    TEST_CHECK(lcdBusyTimeouts == 1);
+    TEST_CHECK(lcdBusyPollMode == 0);
+    TEST_CHECK(elapsed >= LCD_BUSY_TIMEOUT_US);
+    TEST_CHECK(elapsed < 2 * LCD_BUSY_TIMEOUT_US + 20000);
+    TEST_CHECK(simLCD[0].displayOn && !simLCD[0].decrement && !simLCD[0].address);
+    TEST_CHECK(simLCDoverruns == 0);
+    lcdBusyTimeouts = 0;
+}
+
+// the same once the queue is running. The entry waiting on the flag goes after
+// LCD_BUSY_TIMEOUT_US and the rest of the redraw is paced by the fixed times
+void testStuckBusyQueue() {
+    if(titleScreenFlag) testPress(1 << KEY_HASH, 20);
+    testFlush();
+
+    simLCDstuckBusy = 1;
+    unsigned int start = micros();
+    markAllCellsDirty();
+    testFlush();
+    unsigned int elapsed = micros() - start;
+    simLCDstuckBusy = 0;
+
+    TEST_CHECK(lcdBusyTimeouts == 1);
+    TEST_CHECK(lcdBusyPollMode == 0);
+    TEST_CHECK(elapsed >= LCD_BUSY_TIMEOUT_US);
+    TEST_CHECK(testPanelMatches());
+    TEST_CHECK(simLCDoverruns == 0);
+}
+#endif
+
+#if SOUND_DAC
+// the laser sample comes out of the DAC unchanged when nothing else is playing. Timer0
+// is not simulated, so its 1 ms interrupt is run by hand between DAC samples
+void testDac() {
+    static unsigned int output[100 * DAC_RATE_HZ / 1000];
+    int samples = 0;
+
+    // let the music and anything from the game die away, then fire
+    musicStop();
+    for(int ms = 0; ms < 400; ms++){
+        if(ms == 300) soundPlay(SFX_LASER);
+        T0IR = (1<<0);
+        TIMER0_IRQHandler();
+        for(int n = 0; n < DAC_RATE_HZ / 1000; n++){
+            simDacRun(1);
+            if(ms >= 300) output[samples++] = (DACR >> 6) & 0x3FF;
+        }
+    }
+
+    int first = 0;
+    while(first < samples && output[first] == DAC_MIDSCALE) first++;
+    int wrong = 0;
+    for(int n = 0; n < (int) sizeof(laserPcm) && first + n < samples; n++){
+        if((int) output[first + n] - DAC_MIDSCALE != laserPcm[n] - 128) wrong++;
+    }
+    TEST_CHECK(first < samples);
+    TEST_CHECK(first + (int) sizeof(laserPcm) <= samples);
+    TEST_CHECK(wrong == 0);
+}
+#endif
+
+int main(void) {
+    srand((unsigned) 100);
+
+    clockInitialize();
+#if LCD_BUSY_POLL
+    testStuckBusyInit();
+#endif
+    InitializeLCD();
+    LCDqueueInitialize();
+#if LCD_BENCHMARK
+    testBenchmark();
+#endif
+    soundInitialize();
+    TimerInterruptInitialize();
+    tickInitialize();
+    keypadInitialize();
+    titleScreenFlag = 1;
+
+    testTitle();
+    testDebounce();
+    testStart();
+    testMove();
+    testRedraw();
+    testPlay();
+#if LCD_BUSY_POLL
+    testStuckBusyQueue();
+#endif
+#if SOUND_DAC
+    testDac();
+#endif
+
+    printf("%d checks failed\n", testFailures);
+    return testFailures != 0;
+}
+#endif
+#endif